@@ -0,0 +1,165 @@
+//
+// ban_list.hpp
+// ~~~~~~~~~~~~
+//
+// The nicknames a client has banned, kept in memory and in a file.
+//
+
+#ifndef BAN_LIST_HPP
+#define BAN_LIST_HPP
+
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include "asio.hpp"
+
+/*
+  The file holds one nickname per line. It is read once when the list is
+  opened, and the list's own changes are written through to it: a ban is
+  appended, an unban rewrites the file into a temporary one that is renamed
+  over it, so the file is never seen half written or missing.
+
+  Other programs may edit the file too. Its directory is watched with
+  inotify on the io_context, and whenever the file is written, replaced or
+  removed the list is read again. Checking a nickname is then a hash lookup
+  under an uncontended mutex, without touching the file system.
+*/
+class ban_list
+{
+public:
+  explicit ban_list(asio::io_context& io_context)
+    : io_context_(io_context),
+      inotify_(io_context)
+  {
+  }
+
+  ban_list(const ban_list&) = delete;
+  ban_list& operator=(const ban_list&) = delete;
+
+  //Loads the list from path and follows changes made to it from now on.
+  void open(const std::string& path)
+  {
+    std::string::size_type slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "."
+      : slash == 0 ? "/" : path.substr(0, slash);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      path_ = path;
+      file_name_ = slash == std::string::npos ? path : path.substr(slash + 1);
+    }
+    load();
+    asio::post(io_context_,
+        [this, directory]()
+        {
+          watch(directory);
+        });
+  }
+
+  //Stops following changes, so the io_context can run out of work.
+  void close()
+  {
+    asio::post(io_context_,
+        [this]()
+        {
+          std::error_code ignored;
+          inotify_.close(ignored);
+        });
+  }
+
+  bool contains(const std::string& nickname)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return names_.count(nickname) != 0;
+  }
+
+  //Returns false if the nickname was banned already.
+  bool add(const std::string& nickname)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!names_.insert(nickname).second)
+      return false;
+    std::ofstream file(path_.c_str(), std::ofstream::app);
+    file << nickname << std::endl;
+    return true;
+  }
+
+  //Returns false if the nickname was not banned.
+  bool remove(const std::string& nickname)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (names_.erase(nickname) == 0)
+      return false;
+    std::string new_path = path_ + ".new";
+    {
+      std::ofstream file(new_path.c_str(), std::ofstream::trunc);
+      for (const auto& name: names_)
+        file << name << std::endl;
+    }
+    std::rename(new_path.c_str(), path_.c_str());
+    return true;
+  }
+
+private:
+  void load()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    names_.clear();
+    std::ifstream file(path_.c_str());
+    std::string line;
+    while (std::getline(file, line))
+      if (!line.empty())
+        names_.insert(line);
+  }
+
+  void watch(const std::string& directory)
+  {
+    int fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+      return; //The list still works, it just misses outside edits.
+    if (::inotify_add_watch(fd, directory.c_str(),
+          IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0)
+    {
+      ::close(fd);
+      return;
+    }
+    inotify_.assign(fd);
+    do_read_events();
+  }
+
+  void do_read_events()
+  {
+    inotify_.async_read_some(asio::buffer(events_, sizeof(events_)),
+        [this](std::error_code ec, std::size_t length)
+        {
+          if (ec)
+            return;
+          bool changed = false;
+          for (std::size_t offset = 0; offset + sizeof(inotify_event) <= length; )
+          {
+            const inotify_event* event =
+              reinterpret_cast<const inotify_event*>(events_ + offset);
+            if (event->len > 0 && file_name_ == event->name)
+              changed = true;
+            offset += sizeof(inotify_event) + event->len;
+          }
+          if (changed)
+            load();
+          do_read_events();
+        });
+  }
+
+  asio::io_context& io_context_;
+  asio::posix::stream_descriptor inotify_;
+  alignas(inotify_event) char events_[4096];
+  std::mutex mutex_;
+  std::string path_;
+  std::string file_name_; //Within the watched directory.
+  std::unordered_set<std::string> names_;
+};
+
+#endif // BAN_LIST_HPP
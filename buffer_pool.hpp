@@ -0,0 +1,123 @@
+//
+// buffer_pool.hpp
+// ~~~~~~~~~~~~~~~
+//
+// Size-class pooled storage for chat message buffers.
+//
+
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <cstddef>
+#include <cstring>
+
+/*
+  Buffers come in power of two size classes starting at smallest_size. Every
+  thread keeps its own free list per size class, so allocating and freeing
+  never takes a lock. A buffer freed on another thread than the one that
+  allocated it simply joins the freeing thread's list; each list is capped
+  so that a thread which only ever frees cannot hoard memory.
+*/
+class buffer_pool
+{
+public:
+  enum { smallest_size = 32 };
+  enum { num_size_classes = 8 }; //32 bytes up to 4 KB.
+  enum { max_free_buffers = 1024 }; //Per size class and thread.
+
+  //The size class holding at least size bytes.
+  static std::size_t size_class(std::size_t size)
+  {
+    std::size_t c = 0;
+    std::size_t class_size = smallest_size;
+    while (class_size < size)
+    {
+      class_size <<= 1;
+      ++c;
+    }
+    return c;
+  }
+
+  static std::size_t class_size(std::size_t c)
+  {
+    return static_cast<std::size_t>(smallest_size) << c;
+  }
+
+  static char* allocate(std::size_t c)
+  {
+    if (c >= num_size_classes)
+      return new char[class_size(c)];
+
+    free_list& list = lists().classes[c];
+    if (list.head == 0)
+      return new char[class_size(c)];
+
+    char* buffer = list.head;
+    std::memcpy(&list.head, buffer, sizeof(char*));
+    --list.count;
+    return buffer;
+  }
+
+  static void deallocate(char* buffer, std::size_t c)
+  {
+    if (c >= num_size_classes)
+    {
+      delete[] buffer;
+      return;
+    }
+
+    free_list& list = lists().classes[c];
+    if (list.count == max_free_buffers)
+    {
+      delete[] buffer;
+      return;
+    }
+
+    //The link to the next free buffer lives in the buffer itself.
+    std::memcpy(buffer, &list.head, sizeof(char*));
+    list.head = buffer;
+    ++list.count;
+  }
+
+private:
+  struct free_list
+  {
+    char* head;
+    std::size_t count;
+  };
+
+  struct thread_lists
+  {
+    thread_lists()
+    {
+      for (std::size_t c = 0; c < num_size_classes; ++c)
+      {
+        classes[c].head = 0;
+        classes[c].count = 0;
+      }
+    }
+
+    ~thread_lists()
+    {
+      for (std::size_t c = 0; c < num_size_classes; ++c)
+      {
+        while (classes[c].head != 0)
+        {
+          char* buffer = classes[c].head;
+          std::memcpy(&classes[c].head, buffer, sizeof(char*));
+          delete[] buffer;
+        }
+      }
+    }
+
+    free_list classes[num_size_classes];
+  };
+
+  static thread_lists& lists()
+  {
+    static thread_local thread_lists lists;
+    return lists;
+  }
+};
+
+#endif // BUFFER_POOL_HPP
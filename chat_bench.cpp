@@ -0,0 +1,521 @@
+//
+// chat_bench.cpp
+// ~~~~~~~~~~~~~~
+//
+// Microbenchmarks of the code every message goes through, printed as JSON.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "asio.hpp"
+#include "chat_message.hpp"
+#include "chat_room.hpp"
+#include "gather_buffers.hpp"
+#include "handler_memory.hpp"
+#include "nickname_registry.hpp"
+
+/*
+  A benchmark body runs a given number of operations. Each benchmark first
+  doubles that number until one run takes at least the minimum time, which
+  also warms up caches and the buffer pool, then times several runs of that
+  size and reports the median, fastest and slowest time per operation.
+
+  With --baseline the results are compared with the JSON of an earlier run,
+  and the program fails if any benchmark got slower by more than the
+  tolerance, so a regression can be caught before it ships.
+*/
+
+//Keeps the compiler from optimising away a value that is never used.
+template <typename T>
+inline void keep(const T& value)
+{
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+struct bench_config
+{
+  std::string filter; //Only benchmarks whose name contains it.
+  double min_time = 0.1; //Seconds per timed run.
+  std::size_t repetitions = 5;
+  std::string baseline;
+  double tolerance = 10; //Percent.
+};
+
+struct bench_result
+{
+  std::string name;
+  std::uint64_t iterations;
+  double ns_per_op;
+  double min_ns_per_op;
+  double max_ns_per_op;
+};
+
+class bench_runner
+{
+public:
+  explicit bench_runner(const bench_config& config)
+    : config_(config)
+  {
+  }
+
+  template <typename Body>
+  void run(const std::string& name, Body body)
+  {
+    if (name.find(config_.filter) == std::string::npos)
+      return;
+
+    std::uint64_t iterations = 1;
+    while (time(body, iterations) < config_.min_time && iterations < (1ull << 40))
+      iterations *= 2;
+
+    std::vector<double> ns_per_op;
+    for (std::size_t i = 0; i < config_.repetitions; ++i)
+      ns_per_op.push_back(time(body, iterations) * 1e9 / iterations);
+    std::sort(ns_per_op.begin(), ns_per_op.end());
+
+    bench_result result = { name, iterations, ns_per_op[ns_per_op.size() / 2],
+      ns_per_op.front(), ns_per_op.back() };
+    results_.push_back(result);
+  }
+
+  void print(std::ostream& out) const
+  {
+    out << "{\n  \"benchmarks\": [\n";
+    for (std::size_t i = 0; i < results_.size(); ++i)
+    {
+      const bench_result& r = results_[i];
+      char line[512];
+      std::snprintf(line, sizeof(line), "    {\"name\": \"%s\", \"iterations\": %llu, "
+          "\"ns_per_op\": %.2f, \"min_ns_per_op\": %.2f, \"max_ns_per_op\": %.2f}%s\n",
+          r.name.c_str(), static_cast<unsigned long long>(r.iterations),
+          r.ns_per_op, r.min_ns_per_op, r.max_ns_per_op,
+          i + 1 < results_.size() ? "," : "");
+      out << line;
+    }
+    out << "  ]\n}\n";
+  }
+
+  //Reports the benchmarks that got slower than in the baseline.
+  //Returns false if there were any.
+  bool compare(std::istream& baseline) const
+  {
+    std::map<std::string, double> before;
+    std::string line;
+    while (std::getline(baseline, line))
+    {
+      //One benchmark per line, as print() writes them.
+      std::string::size_type name = line.find("\"name\": \"");
+      std::string::size_type ns = line.find("\"ns_per_op\": ");
+      if (name == std::string::npos || ns == std::string::npos)
+        continue;
+      name += 9;
+      before[line.substr(name, line.find('"', name) - name)]
+        = std::atof(line.c_str() + ns + 13);
+    }
+
+    bool ok = true;
+    for (const auto& r: results_)
+    {
+      auto it = before.find(r.name);
+      if (it == before.end() || it->second <= 0)
+        continue;
+      double change = 100 * (r.ns_per_op - it->second) / it->second;
+      if (change > config_.tolerance)
+      {
+        std::fprintf(stderr, "%s: %.2f ns/op, was %.2f ns/op (%+.1f%%)\n",
+            r.name.c_str(), r.ns_per_op, it->second, change);
+        ok = false;
+      }
+    }
+    return ok;
+  }
+
+private:
+  template <typename Body>
+  static double time(Body& body, std::uint64_t iterations)
+  {
+    auto start = std::chrono::steady_clock::now();
+    body(iterations);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  const bench_config& config_;
+  std::vector<bench_result> results_;
+};
+
+//----------------------------------------------------------------------
+
+//Queues what it is given the way a session does, but never writes it anywhere.
+class bench_participant
+  : public chat_participant
+{
+public:
+  void deliver(const chat_message_ptr& msg)
+  {
+    queue_.push_back(msg);
+    if (queue_.size() > max_queued)
+      queue_.pop_front();
+  }
+
+  void deliver(std::vector<chat_message_ptr> msgs)
+  {
+    for (const auto& msg: msgs)
+      deliver(msg);
+  }
+
+private:
+  enum { max_queued = 64 };
+  chat_message_queue queue_;
+};
+
+//Takes the path a chat_session takes from deliver() to its socket: the inbox
+//under its mutex, one drain dispatched onto its strand, the write queue and
+//a gather write in the binary framing. What reaches the other end of its
+//socket pair is read and counted, then thrown away.
+class bench_session
+  : public chat_participant,
+    public std::enable_shared_from_this<bench_session>
+{
+public:
+  bench_session(asio::io_context& io_context, std::size_t& bytes_read)
+    : socket_(io_context),
+      peer_(io_context),
+      strand_(io_context.get_executor()),
+      bytes_read_(bytes_read),
+      drain_scheduled_(false)
+  {
+    asio::local::connect_pair(socket_, peer_);
+  }
+
+  void start()
+  {
+    do_read();
+  }
+
+  void close()
+  {
+    std::error_code ignored;
+    socket_.close(ignored);
+    peer_.close(ignored);
+  }
+
+  void deliver(const chat_message_ptr& msg)
+  {
+    bool schedule;
+    {
+      std::lock_guard<std::mutex> lock(inbox_mutex_);
+      inbox_.push_back(msg);
+      schedule = !drain_scheduled_;
+      drain_scheduled_ = true;
+    }
+    if (schedule)
+      schedule_drain();
+  }
+
+  void deliver(std::vector<chat_message_ptr> msgs)
+  {
+    bool schedule;
+    {
+      std::lock_guard<std::mutex> lock(inbox_mutex_);
+      inbox_.insert(inbox_.end(), msgs.begin(), msgs.end());
+      schedule = !drain_scheduled_;
+      drain_scheduled_ = true;
+    }
+    if (schedule)
+      schedule_drain();
+  }
+
+private:
+  void schedule_drain()
+  {
+    auto self(shared_from_this());
+    asio::dispatch(strand_, make_custom_alloc_handler(deliver_memory_,
+        [this, self]()
+        {
+          drain_inbox();
+        }));
+  }
+
+  void drain_inbox()
+  {
+    for (;;)
+    {
+      {
+        std::lock_guard<std::mutex> lock(inbox_mutex_);
+        if (inbox_.empty())
+        {
+          drain_scheduled_ = false;
+          return;
+        }
+        draining_.swap(inbox_);
+      }
+      bool write_in_progress = !write_msgs_.empty();
+      write_msgs_.insert(write_msgs_.end(), draining_.begin(), draining_.end());
+      if (!write_in_progress)
+        do_write();
+      draining_.clear();
+    }
+  }
+
+  void do_write()
+  {
+    write_buffers_.clear();
+    for (const auto& msg: write_msgs_)
+    {
+      if (write_buffers_.size() + 2 > write_buffers_.capacity)
+        break;
+      write_buffers_.push_back(asio::buffer(msg->binary_header(),
+            chat_message::binary_header_length));
+      write_buffers_.push_back(asio::buffer(msg->body(), msg->body_length()));
+    }
+
+    auto self(shared_from_this());
+    asio::async_write(socket_, write_buffers_.buffers(),
+        asio::bind_executor(strand_, make_custom_alloc_handler(write_memory_,
+        [this, self](std::error_code ec, std::size_t)
+        {
+          if (ec)
+            return;
+          write_msgs_.erase(write_msgs_.begin(),
+              write_msgs_.begin() + write_buffers_.size() / 2);
+          if (!write_msgs_.empty())
+            do_write();
+        })));
+  }
+
+  void do_read()
+  {
+    auto self(shared_from_this());
+    peer_.async_read_some(asio::buffer(read_buffer_),
+        make_custom_alloc_handler(read_memory_,
+        [this, self](std::error_code ec, std::size_t length)
+        {
+          if (ec)
+            return;
+          bytes_read_ += length;
+          do_read();
+        }));
+  }
+
+  asio::local::stream_protocol::socket socket_;
+  asio::local::stream_protocol::socket peer_;
+  strand_type strand_;
+  std::size_t& bytes_read_; //By every session of the benchmark.
+  handler_memory<512> read_memory_;
+  handler_memory<2048> write_memory_;
+  handler_memory<256, 2> deliver_memory_;
+  char read_buffer_[65536];
+  chat_message_queue write_msgs_;
+  gather_buffers<64> write_buffers_;
+  std::mutex inbox_mutex_;
+  std::vector<chat_message_ptr> inbox_;
+  std::vector<chat_message_ptr> draining_;
+  bool drain_scheduled_; //Guarded by inbox_mutex_.
+};
+
+void bench_message(bench_runner& runner)
+{
+  chat_message msg(64);
+  std::memset(msg.body(), 'x', msg.body_length());
+  msg.encode_header();
+
+  runner.run("chat_message/encode_header",
+      [&](std::uint64_t n)
+      {
+        for (std::uint64_t i = 0; i < n; ++i)
+        {
+          msg.encode_header();
+          keep(msg);
+        }
+      });
+
+  runner.run("chat_message/decode_header",
+      [&](std::uint64_t n)
+      {
+        for (std::uint64_t i = 0; i < n; ++i)
+          keep(msg.decode_header());
+      });
+
+  runner.run("chat_message/decode_binary_header",
+      [&](std::uint64_t n)
+      {
+        for (std::uint64_t i = 0; i < n; ++i)
+          keep(msg.decode_binary_header());
+      });
+
+  const std::size_t sizes[] = { 16, 128, 512 };
+  for (std::size_t size: sizes)
+  {
+    std::string text(size, 'x');
+    runner.run("string_to_msg/" + std::to_string(size),
+        [&](std::uint64_t n)
+        {
+          for (std::uint64_t i = 0; i < n; ++i)
+            keep(string_to_msg(text));
+        });
+  }
+}
+
+//One message delivered to every participant of a room, run on its strand.
+void bench_room(bench_runner& runner)
+{
+  const std::size_t sizes[] = { 1, 10, 100, 1000 };
+  for (std::size_t size: sizes)
+  {
+    asio::io_context io_context;
+    auto work = asio::make_work_guard(io_context);
+    chat_room room(io_context);
+    for (std::size_t i = 0; i < size; ++i)
+      room.join(std::make_shared<bench_participant>());
+    io_context.poll();
+
+    chat_message_ptr msg = string_to_msg("bench [12:00] : a message of some length");
+    runner.run("chat_room/deliver/" + std::to_string(size),
+        [&](std::uint64_t n)
+        {
+          for (std::uint64_t i = 0; i < n; ++i)
+          {
+            room.deliver(msg);
+            io_context.poll();
+          }
+        });
+  }
+
+  //The same, into sessions, until every byte has been read back out of
+  //their sockets. The room and the sessions share one thread, as they do
+  //when they are on the same shard.
+  for (std::size_t size: sizes)
+  {
+    asio::io_context io_context;
+    auto work = asio::make_work_guard(io_context);
+    std::size_t bytes_read = 0;
+    std::vector<std::shared_ptr<bench_session>> sessions;
+    {
+      chat_room room(io_context);
+      for (std::size_t i = 0; i < size; ++i)
+      {
+        sessions.push_back(std::make_shared<bench_session>(io_context, bytes_read));
+        sessions.back()->start();
+        room.join(sessions.back());
+      }
+      io_context.poll();
+
+      chat_message_ptr msg = string_to_msg("bench [12:00] : a message of some length");
+      std::size_t msg_bytes = chat_message::binary_header_length + msg->body_length();
+      runner.run("chat_session/deliver/" + std::to_string(size),
+          [&](std::uint64_t n)
+          {
+            for (std::uint64_t i = 0; i < n; ++i)
+            {
+              std::size_t expected = bytes_read + size * msg_bytes;
+              room.deliver(msg);
+              while (bytes_read < expected)
+                io_context.run_one();
+            }
+          });
+    }
+
+    //Lets the reads and writes still in flight finish before the sessions go.
+    for (const auto& session: sessions)
+      session->close();
+    work.reset();
+    io_context.run();
+  }
+}
+
+void bench_nicknames(bench_runner& runner)
+{
+  enum { num_names = 10000 };
+  nickname_registry<bench_participant> names;
+  std::vector<std::shared_ptr<bench_participant>> participants;
+  std::vector<std::string> known, unknown;
+  for (std::size_t i = 0; i < num_names; ++i)
+  {
+    participants.push_back(std::make_shared<bench_participant>());
+    known.push_back("user" + std::to_string(i));
+    unknown.push_back("nobody" + std::to_string(i));
+    names.insert(known.back(), participants.back());
+  }
+
+  runner.run("nickname_registry/find",
+      [&](std::uint64_t n)
+      {
+        for (std::uint64_t i = 0; i < n; ++i)
+          keep(names.find(known[i % num_names]));
+      });
+
+  runner.run("nickname_registry/find_missing",
+      [&](std::uint64_t n)
+      {
+        for (std::uint64_t i = 0; i < n; ++i)
+          keep(names.find(unknown[i % num_names]));
+      });
+
+  runner.run("nickname_registry/insert_erase",
+      [&](std::uint64_t n)
+      {
+        for (std::uint64_t i = 0; i < n; ++i)
+        {
+          const std::string& name = unknown[i % num_names];
+          keep(names.insert(name, participants[0]));
+          keep(names.erase(name, participants[0].get()));
+        }
+      });
+}
+
+//----------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+  bench_config config;
+  for (int i = 1; i < argc; i += 2)
+  {
+    std::string option = argv[i];
+    std::string value = i + 1 < argc ? argv[i + 1] : "";
+    if (option == "--filter" && i + 1 < argc)
+      config.filter = value;
+    else if (option == "--min-time" && std::atof(value.c_str()) > 0)
+      config.min_time = std::atof(value.c_str()) / 1000;
+    else if (option == "--repetitions" && std::atoi(value.c_str()) > 0)
+      config.repetitions = std::atoi(value.c_str());
+    else if (option == "--baseline" && i + 1 < argc)
+      config.baseline = value;
+    else if (option == "--tolerance" && std::atof(value.c_str()) > 0)
+      config.tolerance = std::atof(value.c_str());
+    else
+    {
+      std::cerr << "Usage: chat_bench [--filter <text>] [--min-time <ms>]"
+        << " [--repetitions <n>] [--baseline <file> [--tolerance <percent>]]\n";
+      return 1;
+    }
+  }
+
+  bench_runner runner(config);
+  bench_message(runner);
+  bench_room(runner);
+  bench_nicknames(runner);
+  runner.print(std::cout);
+
+  if (!config.baseline.empty())
+  {
+    std::ifstream baseline(config.baseline.c_str());
+    if (!baseline)
+    {
+      std::cerr << "Could not read the baseline " << config.baseline << ".\n";
+      return 1;
+    }
+    if (!runner.compare(baseline))
+      return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,306 @@
+//
+// chat_bot.cpp
+// ~~~~~~~~~~~~
+//
+// A chat client without a user interface, driven by lines read from stdin.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <list>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "asio.hpp"
+#include "chat_connection.hpp"
+#include "chat_message.hpp"
+#include "io_context_pool.hpp"
+
+using asio::ip::tcp;
+
+/*
+  Runs one or many bots, each with its own connection and nickname, all
+  sharing a few io_context threads. Every line read from stdin is run by
+  every bot, or by a single bot when it starts with "@<nickname> ":
+
+    <text>              sends a chat message
+    /join <number>      changes chatroom
+    /name <name>        names the current chatroom
+    /delete <number>    deletes an empty chatroom
+    /list [<number>]    lists the chatrooms, from that number on
+    /top [all]          lists the most frequent replies
+    /raw <text>         sends the text to the server as it is
+    /quit               disconnects the bot
+
+  Lines a bot is given before it has logged in wait until it has. Every
+  message the server sends a bot is written to stdout as one line
+  "<nickname><tab><message>" with the newlines and tabs inside the message
+  written as \n and \t. Each line is written with a single fwrite, which
+  stdio keeps whole between threads, into a fully buffered stdout that an
+  output_flusher flushes every 100 ms and once more on exit, so thousands
+  of bots don't pay for a flush per message.
+*/
+
+void print_line(const std::string& nickname, const std::string& text)
+{
+  std::string line = nickname + "\t";
+  for (char c: text)
+  {
+    if (c == '\n')
+      line += "\\n";
+    else if (c == '\t')
+      line += "\\t";
+    else
+      line += c;
+  }
+  line += "\n";
+  std::fwrite(line.data(), 1, line.size(), stdout);
+}
+
+//Flushes stdout every 100 ms until its io_context stops.
+class output_flusher
+{
+public:
+  explicit output_flusher(asio::io_context& io_context)
+    : timer_(io_context)
+  {
+    wait();
+  }
+
+private:
+  void wait()
+  {
+    timer_.expires_after(std::chrono::milliseconds(100));
+    timer_.async_wait(
+        [this](const asio::error_code& error)
+        {
+          if (error)
+            return;
+          std::fflush(stdout);
+          wait();
+        });
+  }
+
+  asio::steady_timer timer_;
+};
+
+class chat_bot
+{
+public:
+  chat_bot(asio::io_context& io_context, const std::string& nickname,
+      const std::string& room, bool quiet, std::atomic<std::size_t>& open)
+    : io_context_(io_context),
+      connection_(io_context),
+      nickname_(nickname),
+      room_(room),
+      quiet_(quiet),
+      logged_in_(false),
+      open_(open)
+  {
+  }
+
+  void start(const tcp::resolver::results_type& endpoints)
+  {
+    ++open_;
+    connection_.on_message([this](const chat_message& msg) { handle(msg); });
+    connection_.on_close(
+        [this]()
+        {
+          if (!quiet_)
+            print_line(nickname_, "(disconnected)");
+          --open_;
+        });
+    connection_.connect(endpoints);
+    //The first message is always the nickname.
+    log_in(nickname_);
+  }
+
+  //Thread safe.
+  void run(const std::string& line)
+  {
+    asio::post(io_context_,
+        [this, line]()
+        {
+          if (logged_in_)
+            do_run(line);
+          else
+            pending_.push_back(line);
+        });
+  }
+
+  //Disconnects once the lines given so far have been sent.
+  void close()
+  {
+    asio::post(io_context_,
+        [this]()
+        {
+          if (logged_in_)
+            connection_.close();
+          else
+            pending_.push_back("/quit");
+        });
+  }
+
+private:
+  //Sends the nickname, trying again with a "_" added for as long as the
+  //server answers that it is taken.
+  void log_in(const std::string& login)
+  {
+    connection_.request(login,
+        [this](const chat_message& msg)
+        {
+          handle(msg);
+          if (std::string(msg.body(), msg.body_length()) == "~!Name")
+          {
+            nickname_ += "_";
+            log_in("~" + nickname_);
+            return;
+          }
+          logged_in_ = true;
+          if (!room_.empty())
+            connection_.write("\\" + room_);
+          for (const auto& line: pending_)
+            do_run(line);
+          pending_.clear();
+        });
+  }
+
+  void handle(const chat_message& msg)
+  {
+    if (!quiet_)
+      print_line(nickname_, std::string(msg.body(), msg.body_length()));
+  }
+
+  void do_run(const std::string& line)
+  {
+    if (line.empty())
+      return;
+    std::string command = line.substr(0, line.find(' '));
+    std::string argument = command.size() < line.size()
+      ? line.substr(command.size() + 1) : std::string();
+    if (command == "/join")
+      connection_.write("\\" + argument);
+    else if (command == "/name")
+      connection_.write("!" + argument);
+    else if (command == "/delete")
+      connection_.write("*" + argument);
+    else if (command == "/list")
+      connection_.write(argument.empty() ? "LOR" : "LOR " + argument);
+    else if (command == "/top")
+      connection_.write(argument == "all" ? "TOP *" : "TOP");
+    else if (command == "/raw")
+      connection_.write(argument);
+    else if (command == "/quit")
+      connection_.close();
+    else
+      connection_.write(chat_line(nickname_, line));
+  }
+
+  asio::io_context& io_context_;
+  chat_connection connection_;
+  std::string nickname_; //Gets a "_" added for as long as it is taken.
+  std::string room_; //Joined once logged in, unless empty.
+  bool quiet_;
+  bool logged_in_;
+  std::vector<std::string> pending_; //Lines given before logging in.
+  std::atomic<std::size_t>& open_;
+};
+
+int main(int argc, char* argv[])
+{
+  try
+  {
+    std::size_t num_bots = 1;
+    std::size_t num_threads = 1;
+    std::string name = "bot";
+    std::string room;
+    bool quiet = false;
+    int first_arg = 1;
+    while (argc > first_arg + 2)
+    {
+      std::string option = argv[first_arg];
+      if (option == "--quiet") //The only option without a value.
+      {
+        quiet = true;
+        ++first_arg;
+        continue;
+      }
+      std::string value = argv[first_arg + 1];
+      if (option == "--bots" && std::atoi(value.c_str()) > 0)
+        num_bots = std::atoi(value.c_str());
+      else if (option == "--threads" && std::atoi(value.c_str()) > 0)
+        num_threads = std::atoi(value.c_str());
+      else if (option == "--name" && !value.empty())
+        name = value;
+      else if (option == "--room")
+        room = value;
+      else
+        break;
+      first_arg += 2;
+    }
+
+    if (argc != first_arg + 2)
+    {
+      std::cerr << "Usage: chat_bot [--bots <n>] [--name <nickname>] [--room <number>]"
+        << " [--threads <n>] [--quiet] <host> <port>\n";
+      return 1;
+    }
+
+    std::setvbuf(stdout, 0, _IOFBF, 1 << 16);
+    io_context_pool pool(num_threads);
+    output_flusher flusher(pool.get_io_context(0));
+    tcp::resolver resolver(pool.get_io_context(0));
+    auto endpoints = resolver.resolve(argv[first_arg], argv[first_arg + 1]);
+
+    //A single bot uses the name as it is, several get it numbered.
+    std::atomic<std::size_t> open(0);
+    std::list<chat_bot> bots;
+    std::map<std::string, chat_bot*> by_name;
+    for (std::size_t i = 0; i < num_bots; ++i)
+    {
+      std::string nickname = num_bots == 1 ? name : name + std::to_string(i);
+      bots.emplace_back(pool.get_io_context(i), nickname, room, quiet, open);
+      by_name[nickname] = &bots.back();
+    }
+    std::thread runner([&pool](){ pool.run(); });
+    for (auto& bot: bots)
+      bot.start(endpoints);
+
+    std::string line;
+    while (std::getline(std::cin, line))
+    {
+      if (line.empty() || line[0] != '@')
+      {
+        for (auto& bot: bots)
+          bot.run(line);
+        continue;
+      }
+      std::string::size_type space = line.find(' ');
+      auto bot = by_name.find(line.substr(1, space == std::string::npos ? space : space - 1));
+      if (bot == by_name.end())
+        std::cerr << "No bot is called " << line.substr(1, space - 1) << ".\n";
+      else if (space != std::string::npos)
+        bot->second->run(line.substr(space + 1));
+    }
+
+    //Give the bots a few seconds to send what they were given.
+    for (auto& bot: bots)
+      bot.close();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (open > 0 && std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    pool.stop();
+    runner.join();
+    std::fflush(stdout);
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+  }
+
+  return 0;
+}
@@ -8,39 +8,31 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
+#include <chrono>
 #include <cstdlib>
 #include <deque>
+#include <future>
 #include <iostream>
+#include <mutex>
 #include <thread>
 #include "asio.hpp"
+#include "ban_list.hpp"
+#include "chat_connection.hpp"
 #include "chat_message.hpp"
 #include <ncurses.h>
 #include <vector>
 #include <algorithm>
-#include <fstream>
-#include <time.h>
 
 using asio::ip::tcp;
 int height,width;
 
-typedef std::deque<chat_message> chat_message_queue;
-std::string chat_room_name = "\0";
 std::string current_chatroom_name = "MAIN LOBBY";
-int room_exists = 0;
-int name_present = 0;
-int delete_chat = 0;
-std::string list_of_chatrooms = "\0";
-std::string new_name = "\0";
 
-std::vector<std::string> store_messages;
 chat_message string_to_msg(std::string n)
 {
-    //Function to convert a string to a chat message.
-    char name[n.length()+ 1];
-    strcpy(name, n.c_str());
-    chat_message msg1;
-    msg1.body_length(std::strlen(name));
-    std::memcpy(msg1.body(), name, msg1.body_length());
+    //Function to convert a string to a chat message, sized to fit the string.
+    chat_message msg1(n.length());
+    std::memcpy(msg1.body(), n.data(), msg1.body_length());
     msg1.encode_header();
     return msg1;
 }
@@ -89,17 +81,34 @@ std::string BackWindow(std::string heading, std::string message, int temp)
 
 //-----------------------------------------------------------------------
 
+/*
+  Only the main thread draws. Messages arriving on the network thread are
+  queued, and the main thread paints them in frames: at most
+  frames_per_second times a second it prints the queued lines that still
+  fit on the chat screen, boxes it once and sends everything to the
+  terminal with a single doupdate. While no chat screen exists the lines
+  stay queued, up to max_queued_lines, and are shown once it is back.
+*/
 class chat_client
 {
 public:
+  enum { max_queued_lines = 1000 };
+
   chat_client(asio::io_context& io_context,
-      const tcp::resolver::results_type& endpoints)
-    : io_context_(io_context),
-      socket_(io_context)
+      const tcp::resolver::results_type& endpoints, int frames_per_second)
+    : connection_(io_context),
+      bans_(io_context),
+      frame_interval_(1000 / frames_per_second),
+      next_frame_(std::chrono::steady_clock::now())
   {
     text_box = NULL;
     chat_screen = NULL;
-    do_connect(endpoints);
+    connection_.on_message(
+        [this](const chat_message& msg)
+        {
+          handle_message(std::string(msg.body(), msg.body_length()));
+        });
+    connection_.connect(endpoints);
   }
 
   void build_chat_screen()
@@ -146,6 +155,33 @@ public:
     refresh_all();
   }
 
+  //Paints the queued lines when a frame is due, or at once if forced.
+  void render(bool force = false)
+  {
+    auto now = std::chrono::steady_clock::now();
+    if(chat_screen == NULL || text_box == NULL || (!force && now < next_frame_))
+      return;
+    std::deque<std::string> lines;
+    {
+      std::lock_guard<std::mutex> lock(lines_mutex_);
+      lines.swap(queued_lines_);
+    }
+    if(lines.empty() && !force)
+      return;
+    next_frame_ = now + frame_interval_;
+
+    //Lines that would scroll off within this frame are never drawn.
+    std::size_t visible = getmaxy(chat_screen);
+    std::size_t first = lines.size() > visible ? lines.size() - visible : 0;
+    for(std::size_t i = first; i < lines.size(); ++i)
+      wprintw(chat_screen, " %s\n", lines[i].c_str());
+    box(chat_screen, 0, 0);
+    box(text_box, 0, 0);
+    wnoutrefresh(chat_screen);
+    wnoutrefresh(text_box); //Last, so the cursor stays in the text box.
+    doupdate();
+  }
+
   char *get_text(WINDOW *win, int y, int x)
   {
     char *input = (char *)malloc(200 * sizeof(char));
@@ -155,11 +191,16 @@ public:
     keypad(win, TRUE);
     cbreak();
     wmove(win, y, x + 1);
+    //Waking up once a frame to paint the messages that came in meanwhile.
+    wtimeout(win, frame_interval_.count());
     int ch = wgetch(win);
 
     while (ch != '\n')
     {
-      if (i == 0 && ch == KEY_BACKSPACE)
+      if (ch == ERR)
+      {
+      }
+      else if (i == 0 && ch == KEY_BACKSPACE)
       {
       }
       else if (i > 0 && ch == KEY_BACKSPACE)
@@ -179,8 +220,12 @@ public:
         input[i] = (char)ch;
         i++;
       }
+      //Keys arriving faster than the timeout must not hold frames back;
+      //render() only paints when a frame is due.
+      render();
       ch = wgetch(win);
     }
+    wtimeout(win, -1);
     cbreak();
     echo();
     wrefresh(win);
@@ -189,306 +234,157 @@ public:
 
   void refresh_all()
   {
-    box(chat_screen, 0, 0);
-    box(text_box, 0, 0);
-    wrefresh(chat_screen);
-    wrefresh(text_box);
+    render(true);
   }
 
   void send_recent_messages()
   {
-    if(chat_screen == NULL)
-      return;
-    for(auto i =0;i<(int)store_messages.size();i++)
-    {
-      wprintw(chat_screen, " %s\n", store_messages[i].c_str());
-    }
-    store_messages.clear();
-    refresh_all();
+    render(true);
   }
 
   void write(const chat_message& msg)
   {
-    asio::post(io_context_,
-        [this, msg]()
-        {
-          std::string a = msg.body();
-          bool write_in_progress = !write_msgs_.empty();
-          write_msgs_.push_back(msg);
-          if (!write_in_progress)
-          {
-            do_write();
-          }
-        });
+    connection_.write(msg);
   }
 
-  void close()
+  //Sends a command and returns the server's answer to it once it arrives.
+  std::future<std::string> request(const std::string& command)
   {
-    asio::post(io_context_, [this]() { socket_.close(); });
+    return connection_.request(command);
   }
 
-  void ban_user(std::string user, std::string user_to_ban)
+  void close()
   {
-    std::ifstream ifile;
-    std::ofstream ofile;
-
-    std::string file_name = user + "_ban_list.txt";
-
-    ifile.open(file_name);
-    if(ifile.is_open() )    //Checking for existing file
-    {
-      std::string line;
-      bool found = false;
-
-      while(std::getline(ifile, line) )   //Check if user exists in ban list already
-      {
-        if(line == user_to_ban)
-        {
-          found = true;
-          display_msg("User "+ user_to_ban +" Already Banned.");
-        }
-      }
-      ifile.close();
+    bans_.close();
+    connection_.close();
+  }
 
-      if(!found)    //User not found in ban list
-      {
-        ofile.open(file_name, std::ofstream::app);
-        ofile << user_to_ban << std::endl;
-        ofile.close();
-        display_msg("Banned "+user_to_ban+".");
-      }
-    }
-    else    //File doesn't exist yet
-    {
-      ofile.open(file_name, std::fstream::app);
-      ofile << user_to_ban << std::endl;
-      ofile.close();
+  void ban_user(std::string user_to_ban)
+  {
+    if(bans_.add(user_to_ban))
       display_msg("Banned "+user_to_ban+".");
-    }
+    else
+      display_msg("User "+ user_to_ban +" Already Banned.");
   }
 
-  void unban_user(std::string user, std::string user_to_unban) //methord called to unban the user
+  void unban_user(std::string user_to_unban) //methord called to unban the user
   {
-    std::ifstream ifile;
-    std::ofstream ofile;
-
-    std::string file_name = user + "_ban_list.txt";
-    std::string file_name_new = user + "_ban_list_new.txt";
-
-    char c_file_name[file_name.length() + 1];
-    char c_file_name_new[file_name_new.length() + 1];
-
-    strcpy(c_file_name, file_name.c_str() );    //converting std::string into char[]
-    strcpy(c_file_name_new, file_name_new.c_str() );
-
-    ifile.open(c_file_name);
-    if(ifile.is_open() )    //Checking for existing file
-    {
-      ofile.open(c_file_name_new, std::ofstream::app);
-      std::string line;
-      bool found = false;
-
-      while(std::getline(ifile, line) )   //Check if user exists in ban list
-      {
-        if(line == user_to_unban)
-        {
-          found = true;
-          display_msg("Unbanned " + user_to_unban);
-        }
-        else
-        {
-          ofile << line << std::endl;
-        }
-      }
-      ifile.close();
-      ofile.close();
-
-      std::remove(c_file_name);
-      std::rename(c_file_name_new, c_file_name);
-
-      if(!found)
-      {
-        display_msg("User " + user_to_unban + " not found on the ban list.");
-      }
-    }
+    if(bans_.remove(user_to_unban))
+      display_msg("Unbanned " + user_to_unban);
+    else
+      display_msg("User " + user_to_unban + " not found on the ban list.");
   }
 
-  bool check_ban(std::string user, std::string user_to_check)
+  bool check_ban(std::string user_to_check)
   {
-    std::ifstream ifile;
-
-    std::string file_name = user + "_ban_list.txt";
-
-    ifile.open(file_name);
-    if(ifile.is_open() )    //Checking for existing file
-    {
-      std::string line;
-
-      while(std::getline(ifile, line) )   //Check if user exists in ban list already
-      {
-        if(line == user_to_check)
-        {
-          return true;
-        }
-      }
-      ifile.close();
-    }
-
-    return false;
+    return bans_.contains(user_to_check);
   }
 
   void set_nickname(std::string n_name)
   {
     nickname = n_name;
+    //The nicknames this user has banned, kept up to date with the file.
+    bans_.open(nickname + "_ban_list.txt");
   }
 
   
 private:
-  void do_connect(const tcp::resolver::results_type& endpoints)
+  //Comes here when a message is recieved from the server.
+  //The answers to commands go to their requests, so every message that
+  //arrives here is a chat message.
+  void handle_message(std::string temp)
   {
-    asio::async_connect(socket_, endpoints,
-        [this](std::error_code ec, tcp::endpoint)
-        {
-          if (!ec)
-          {
-            do_read_header();
-          }
-        });
+    std::string delim = " [";
+    int nickname_loc_end = temp.find(delim);
+    std::string user_to_check = temp.substr(0, nickname_loc_end);
+    //Checking if the sender of the message is banned by the client
+    //If the sender is banned, the message is not displayed
+    if(!check_ban(user_to_check))
+    {
+      //Queued for the main thread, which shows it with the next frame.
+      std::lock_guard<std::mutex> lock(lines_mutex_);
+      queued_lines_.push_back(temp);
+      if(queued_lines_.size() > max_queued_lines)
+        queued_lines_.pop_front();
+    }
   }
 
-  void do_read_header()
+private:
+  chat_connection connection_;
+  ban_list bans_;
+  WINDOW *chat_screen;
+  WINDOW *text_box;
+  std::string nickname;
+  std::mutex lines_mutex_;
+  std::deque<std::string> queued_lines_; //Received and not yet shown.
+  std::chrono::milliseconds frame_interval_;
+  std::chrono::steady_clock::time_point next_frame_;
+};
+
+/*
+  Shows the list of chatrooms one page at a time and returns what the user
+  entered. The server ends a page with ">>more:<number>" when more chatrooms
+  follow; entering n then asks for the page starting at that number.
+*/
+std::string choose_chatroom(chat_client& c, std::string footer)
+{
+  std::string request = "LOR";
+  while(true)
   {
-    asio::async_read(socket_,
-        asio::buffer(read_msg_.data(), chat_message::header_length),
-        [this](std::error_code ec, std::size_t /*length*/)
-        {
-          if (!ec && read_msg_.decode_header())
-          {
-            do_read_body();
-          }
-          else
-          {
-            socket_.close();
-          }
-        });
+    //Asking the server for the list of chatrooms and waiting for the answer, "[]LOR:<page>".
+    std::string page = c.request(request).get().substr(6);
+    std::string next;
+    std::string::size_type more = page.find("\n\t>>more:");
+    if(more != std::string::npos)
+    {
+      next = page.substr(more + 9);
+      page = page.substr(0, more) + "\n\tEnter n for the next page.";
+    }
+    clear();
+    refresh();
+    //Prompting the user to enter the number of the chatroom.
+    std::string number = BackWindow("Enter Chatroom Number",page+footer,1);
+    if(number != "n" || next.empty())
+      return number;
+    request = "LOR " + next;
   }
+}
 
-  void do_read_body()
+//Closes the connection and joins the thread running it, however main is left.
+class connection_thread_guard
+{
+public:
+  connection_thread_guard(chat_client& c, std::thread& t)
+    : c_(c),
+      t_(t)
   {
-    asio::async_read(socket_,
-        asio::buffer(read_msg_.body(), read_msg_.body_length()),
-        [this](std::error_code ec, std::size_t /*length*/)
-        {
-          //Comes here when a message is recieved from the server.
-          std::string temp = read_msg_.body();
-          temp = temp.substr(0,read_msg_.body_length());
-          if (!ec)
-          {
-            //Various Checks to see if the message recieved are special messages
-            if(temp[0] == '\\') //Message recieved about changing chatrooms
-            {
-              if(temp[1]=='\\') //The chatroom the user wants to join doesnt exist
-                chat_room_name = "!!";
-              else  //The chatroom the user wants to join exists
-                current_chatroom_name = temp.substr(1,temp.length());
-              room_exists =1;
-              do_read_header();
-            }
-            else if(temp[0] == '~') //Message recieved about Nickname
-            {
-              if(temp[1] == '!')
-                new_name = "!!";
-              name_present = 1;
-              do_read_header();
-            }
-            else if(temp[0] == '*') //Message recieved about deleting chatrooms
-            {
-              if(temp[1]=='!')
-                delete_chat = 1;
-              else
-                delete_chat = 2;
-              do_read_header();
-            }
-            else if(temp[0] == '[' && temp[1] == ']' && temp[2] == 'L' && temp[3] == 'O' && temp[4] =='R') //Checking if the message recieved is the list of chatrooms
-            {
-              temp= temp.substr(6,temp.length());
-              list_of_chatrooms = temp;
-              do_read_header();
-            }
-            else //Just a regular message
-            {
-              std::string delim = " [";
-              int nickname_loc_end = temp.find(delim);
-              std::string user_to_check = temp.substr(0, nickname_loc_end);
-              //Checking if the sender of the message is banned by the client
-              //If the sender is banned, the message is not displayed
-              if(!check_ban(nickname, user_to_check))
-              {
-                //Checking if the screen to print exists
-                if(chat_screen == NULL)
-                {
-                  //The screen doesnt exist, therefore all the messages are saved in the vector till the chat screen is created
-                  store_messages.push_back(temp);
-                }
-                else
-                {
-                  //Displaying the message recieved to the client
-                  char input[500] = {'\0'};
-                  std::strncpy(input, read_msg_.body(), read_msg_.body_length());
-                  wprintw(chat_screen, " %s\n", input);
-                  box(chat_screen, 0, 0);
-                  refresh_all();
-                }
-              }
-              do_read_header();
-            }
-          }
-          else
-          {
-            socket_.close();
-          }
-        });
   }
 
-  void do_write()
+  ~connection_thread_guard()
   {
-    asio::async_write(socket_,
-        asio::buffer(write_msgs_.front().data(),
-          write_msgs_.front().length()),
-        [this](std::error_code ec, std::size_t /*length*/)
-        {
-          if (!ec)
-          {
-            write_msgs_.pop_front();
-            if (!write_msgs_.empty())
-            {
-              do_write();
-            }
-          }
-          else
-          {
-            socket_.close();
-          }
-        });
+    c_.close();
+    t_.join();
   }
 
 private:
-  asio::io_context& io_context_;
-  tcp::socket socket_;
-  chat_message read_msg_;
-  chat_message_queue write_msgs_;
-  WINDOW *chat_screen;
-  WINDOW *text_box;
-  std::string nickname;
+  chat_client& c_;
+  std::thread& t_;
 };
 
 int main(int argc, char* argv[])
 {
   try
   {
-    if (argc != 3)
+    int frames_per_second = 20;
+    int first_arg = 1;
+    if (argc == 5 && std::strcmp(argv[1], "--fps") == 0 && std::atoi(argv[2]) > 0)
     {
-      std::cerr << "Usage: chat_client <host> <port>\n";
+      frames_per_second = std::min(std::atoi(argv[2]), 1000);
+      first_arg = 3;
+    }
+    if (argc != first_arg + 2)
+    {
+      std::cerr << "Usage: chat_client [--fps <frames per second>] <host> <port>\n";
       return 1;
     }
     //Initializing Ncurses
@@ -502,35 +398,24 @@ int main(int argc, char* argv[])
     asio::io_context io_context;
 
     tcp::resolver resolver(io_context);
-    auto endpoints = resolver.resolve(argv[1], argv[2]);
-    chat_client c(io_context, endpoints);
+    auto endpoints = resolver.resolve(argv[first_arg], argv[first_arg + 1]);
+    chat_client c(io_context, endpoints, frames_per_second);
     
-    time_t my_time;
     int current_chatroom = 0;
     int temp;
     std::thread t([&io_context](){ io_context.run(); });
+    connection_thread_guard guard(c, t);
     char line[chat_message::max_body_length + 1];
-    c.write(string_to_msg(n_name));
     //Checking for Same nicknames
-    while(true)
+    //The process of checking the name continues till the user enters a valid name
+    std::string login = n_name;
+    while(c.request(login).get() == "~!Name")
     {
-      //Infinite loop till the server responds.
-      while(name_present == 0) {}
-      if(new_name != "\0")  //Checking if the name already exists.
-      {
-        //Prompting the user to enter the name again.
-        std::string a = BackWindow("ERROR : Name already Exists","Enter another Nickname",0);
-        new_name = "\0";
-        name_present = 0;
-        n_name = a;
-		    a="~"+a; 
-        clear();
-        //Sending message to the server with the new name 
-        c.write(string_to_msg(a));
-      }
-      //The process of checking the name continues till the user enters a valid name
-      else //The name is valid
-        break;
+      //Prompting the user to enter the name again.
+      n_name = BackWindow("ERROR : Name already Exists","Enter another Nickname",0);
+      clear();
+      //Sending the new name to the server, which takes it with "~" in front after the first try.
+      login = "~" + n_name;
     }
     //End of same nickname check
     c.set_nickname(n_name);
@@ -554,15 +439,8 @@ int main(int argc, char* argv[])
       //Checking if the user wants to change chatrooms
       if(strcmp(line,"/change chatroom") == 0)
       {
-        //Sending message to the server to provide with the list of chatrooms
-        c.write(string_to_msg("LOR"));
-        //Infinite loop till the server responds (waiting for the server to respond)
-        while(list_of_chatrooms == "\0") {}
-        clear();
-        refresh();
         //Prompting the user to enter the number of the chatroom they want to join
-        std::string number = BackWindow("Enter Chatroom Number",list_of_chatrooms+"\n\tFor any other number chatroom will be created.\0",1);
-        list_of_chatrooms = "\0";
+        std::string number = choose_chatroom(c, "\n\tFor any other number chatroom will be created.");
         //Changing chatrooms if the number entered is valid.
         try
         {
@@ -583,52 +461,50 @@ int main(int argc, char* argv[])
           c.display_msg("In the chatroom already.");
           continue;
         }
-        if(temp >9 || temp<0)
+        if(temp<0 || temp>999999999)
         {
           c.refresh_all();
           c.send_recent_messages();
-          c.display_msg("Maximum chatroom limit is 9. Enter a chatroom number below 9.");
+          c.display_msg("Chatroom numbers go from 0 to 999999999.");
           continue;
         }
         c.delete_chat_screen();
         c.delete_text_box();
         //Sending a message to the server to check if the chatroom the user wants to join already exists
-        std::string chat_room_msg = "\\" +std::to_string(temp);
-        msg = string_to_msg(chat_room_msg);
-        c.write(msg);
-        while(room_exists == 0) {}
+        std::string answer = c.request("\\" +std::to_string(temp)).get();
+        if(answer == "\\!") //The server has no space for another chatroom.
+        {
+          c.build_chat_screen();
+          c.build_text_box();
+          c.send_recent_messages();
+          c.display_msg("Could not change chatroom. No more chatrooms can be created.");
+          continue;
+        }
         /*
           If the chatroom doesn't exist then the user is prompted to enter the name of the chatroom,
           otherwise if the chatroom already exists then the user just joins the chatroom.
         */
-        if(chat_room_name!="\0")
+        if(answer == "\\\\") //The chatroom the user wants to join doesnt exist
         {
           std::string t = BackWindow("","Enter Chatroom Name",0);
           current_chatroom_name = t;
           t = "!"+ t;
-          chat_room_name = "\0";
           c.write(string_to_msg(t));
         }
+        else
+          current_chatroom_name = answer.substr(1);
         c.build_chat_screen();
         c.build_text_box();
         c.display_msg("Changed Chatroom.");
         c.send_recent_messages();
-        room_exists=0;
         current_chatroom = temp;
         continue;
       }
       //Checking if the user wants to delete any chatroom
       if(strcmp(line,"/delete chatroom") == 0)
       {
-        //Sending message to the server to provide with the list of chatrooms
-        c.write(string_to_msg("LOR"));
-        //Infinite loop till the server responds (waiting for the server to respond)
-        while(list_of_chatrooms == "\0") {}
-        clear();
-        refresh();
         //Prompting the user to enter the number of the chatroom they want to delete.
-        std::string number = BackWindow("Enter Chatroom Number",list_of_chatrooms,1);
-        list_of_chatrooms = "\0";
+        std::string number = choose_chatroom(c, "");
     
         c.refresh_all();
         c.send_recent_messages();
@@ -651,15 +527,13 @@ int main(int argc, char* argv[])
           c.display_msg("Cannot delete Main Lobby.");
           continue;
         }
-        if(temp>9)
+        if(temp<0)
         {
           c.display_msg("Cannot delete a Chatroom which does'nt exist.");
           continue;
         }
         std::string buffer = "*" +std::to_string(temp);
-        c.write(string_to_msg(buffer));
-        while(delete_chat == 0) {}
-        if(delete_chat == 1)
+        if(c.request(buffer).get() == "*!")
         {
          c.display_msg("Error: Did'nt Delete Chatroom. Maybe there are some clients in the chatroom or it doesnt exist.");
         }
@@ -667,9 +541,54 @@ int main(int argc, char* argv[])
         {
           c.display_msg("Deleted Chatroom.");
         }
-        delete_chat =0;
         continue;
       }
+      if(strcmp(line,"/top") == 0 || strcmp(line,"/top all") == 0)
+      {
+        //Asking the server for the most frequent replies in this chatroom or in all of them.
+        //The answer is "[]TOP:" followed by the list.
+        std::string list = c.request(strcmp(line,"/top") == 0 ? "TOP" : "TOP *").get().substr(6);
+        //Every line of the answer is "\n\t<count>      <reply>".
+        std::vector<std::string> replies;
+        std::string shown;
+        std::string::size_type pos = 0;
+        while((pos = list.find("\n\t", pos)) != std::string::npos)
+        {
+          pos += 2;
+          std::string::size_type end = list.find("\n\t", pos);
+          std::string entry = list.substr(pos, end == std::string::npos ? end : end - pos);
+          std::string::size_type gap = entry.find("      ");
+          if(gap == std::string::npos)
+            continue;
+          replies.push_back(entry.substr(gap + 6));
+          shown += "\n\t" + std::to_string(replies.size()) + ". " + replies.back()
+            + " (" + entry.substr(0, gap) + ")";
+        }
+        clear();
+        refresh();
+        if(replies.empty())
+          shown = "\n\tNo replies yet.";
+        else
+          shown += "\n\n\tEnter a number to send that reply.";
+        std::string number = BackWindow("Suggested Replies",shown,1);
+        c.refresh_all();
+        c.send_recent_messages();
+        std::size_t choice;
+        try
+        {
+          choice = std::stoul(number);
+        }
+        catch(const std::exception& e)
+        {
+          continue;
+        }
+        if(choice < 1 || choice > replies.size())
+          continue;
+        //The chosen reply is sent like a message the user typed.
+        std::string reply = replies[choice - 1].substr(0, chat_message::max_body_length / 2);
+        reply.copy(line, reply.size());
+        line[reply.size()] = '\0';
+      }
       if(strcmp(line, "/ban") == 0)
       {
         clear();
@@ -680,7 +599,7 @@ int main(int argc, char* argv[])
           it just blocks all messages recived from that user.
         */
         std::string user_to_ban = BackWindow("","Enter the nickname of the user you want to ban: " ,0);
-        c.ban_user(n_name, user_to_ban);
+        c.ban_user(user_to_ban);
         c.refresh_all();
         continue;
       }
@@ -691,7 +610,7 @@ int main(int argc, char* argv[])
         //Prompting the user to enter the nickname of the user they want to unban
         //If the nickname they enter is not on the ban list a error message is displayed.
         std::string user_to_unban  = BackWindow("","Enter the nickname of the user you want to unban: ",0);;
-        c.unban_user(n_name, user_to_unban);
+        c.unban_user(user_to_unban);
         c.refresh_all();
         continue;
       }
@@ -701,6 +620,7 @@ int main(int argc, char* argv[])
         wprintw(helpwin,"\n");
         wprintw(helpwin," %15s : creates a chatroom.\n","/change chatroom");
         wprintw(helpwin," %15s : deletes a chatroom.\n","/delete chatroom");
+        wprintw(helpwin," %15s  : suggests replies (add all for every chatroom).\n","/top");
         wprintw(helpwin," %15s  : quits the program.\n","/quit");
         wprintw(helpwin," %15s  : Bans a user.\n","/ban");
         wprintw(helpwin," %15s  : Unbans a user.\n","/unban");
@@ -718,27 +638,26 @@ int main(int argc, char* argv[])
         continue;
       
       //Just a regular message
-      my_time = time(NULL);
-      struct tm *time_data = localtime(&my_time);
-      std::string hour = std::to_string(time_data->tm_hour);
-      std::string min = std::to_string(time_data->tm_min);
-      if(time_data->tm_hour < 10)
-        hour = "0"+hour;
-      if(time_data->tm_min < 10)
-        min = "0"+min;
-      //All the information is saved in variable fullline (including the name of the user, message, time)
-      //This message is then sent to the server to distribute.
-      std::string fullline = n_name + " [" + hour+":"+min + "] : " + line; 
+      //The name of the user, the time and the message are sent to the server to distribute.
+      std::string fullline = chat_line(n_name, line);
       msg = string_to_msg(fullline);
       c.write(msg);
       c.refresh_all();
     }
     endwin();
-    c.close();
-    t.join();
+  }
+  catch (std::future_error&)
+  {
+    //An answer the client waited for was dropped with the connection.
+    if (!isendwin())
+      endwin();
+    std::cerr << "Disconnected from the server.\n";
+    return 1;
   }
   catch (std::exception& e)
   {
+    if (!isendwin())
+      endwin();
     std::cerr << "Exception: " << e.what() << "\n";
   }
 
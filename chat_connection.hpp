@@ -0,0 +1,324 @@
+//
+// chat_connection.hpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// The client side of one connection to chat_server, without any user interface.
+//
+
+#ifndef CHAT_CONNECTION_HPP
+#define CHAT_CONNECTION_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include "asio.hpp"
+#include "chat_message.hpp"
+#include "gather_buffers.hpp"
+#include "handler_memory.hpp"
+
+//A chat message as clients send it: "<nickname> [HH:MM] : <text>".
+inline std::string chat_line(const std::string& nickname, const std::string& text)
+{
+  std::time_t now = std::time(0);
+  std::tm local;
+  char clock[8];
+  std::strftime(clock, sizeof(clock), "%H:%M", ::localtime_r(&now, &local));
+  return nickname + " [" + clock + "] : " + text;
+}
+
+/*
+  Connects, asks for the binary framing and then hands every text message
+  the server sends to the message handler. Pings are answered here, so the
+  owner never sees them. Handlers run on the io_context's thread and the
+  connection must outlive the io_context's run().
+
+  A command sent with request() gets the next request id, and the answer
+  the server sends back with that id goes to the request's own handler, or
+  completes its future, instead of the message handler. Any number of
+  requests can be waiting at once. Requests still waiting when the
+  connection closes are dropped, which breaks their futures.
+*/
+class chat_connection
+{
+public:
+  typedef std::function<void(const chat_message&)> message_handler;
+  typedef std::function<void()> close_handler;
+  typedef std::function<void(const chat_message&)> response_handler;
+
+  //Messages one gather write may take from the queue.
+  enum { max_write_msgs = 32 };
+
+  explicit chat_connection(asio::io_context& io_context)
+    : io_context_(io_context),
+      socket_(io_context),
+      connected_(false),
+      closing_(false),
+      closed_(false),
+      last_request_id_(0)
+  {
+  }
+
+  chat_connection(const chat_connection&) = delete;
+  chat_connection& operator=(const chat_connection&) = delete;
+
+  void on_message(message_handler handler)
+  {
+    message_handler_ = std::move(handler);
+  }
+
+  //Called once when the connection fails or is closed.
+  void on_close(close_handler handler)
+  {
+    close_handler_ = std::move(handler);
+  }
+
+  void connect(const asio::ip::tcp::resolver::results_type& endpoints)
+  {
+    asio::async_connect(socket_, endpoints,
+        [this](std::error_code ec, asio::ip::tcp::endpoint)
+        {
+          if (!ec)
+          {
+            socket_.set_option(asio::ip::tcp::no_delay(true), ec);
+            do_hello();
+          }
+          else
+          {
+            do_close();
+          }
+        });
+  }
+
+  //Thread safe; messages written before the handshake are sent once it is done.
+  void write(const chat_message& msg)
+  {
+    asio::post(io_context_,
+        [this, msg]()
+        {
+          queue(msg);
+        });
+  }
+
+  void write(const std::string& body)
+  {
+    write(make_message(body));
+  }
+
+  //Thread safe; handler gets the server's answer to body.
+  void request(const std::string& body, response_handler handler)
+  {
+    chat_message msg = make_message(body);
+    asio::post(io_context_,
+        [this, msg, handler]() mutable
+        {
+          if (closed_)
+            return;
+          do
+            last_request_id_ = (last_request_id_ + 1) & chat_message::max_request_id;
+          while (last_request_id_ == 0 || requests_.count(last_request_id_));
+          msg.request_id(last_request_id_);
+          msg.encode_header();
+          requests_[last_request_id_] = std::move(handler);
+          queue(msg);
+        });
+  }
+
+  //Thread safe; the future holds the body of the server's answer to body.
+  std::future<std::string> request(const std::string& body)
+  {
+    auto answer = std::make_shared<std::promise<std::string>>();
+    request(body,
+        [answer](const chat_message& msg)
+        {
+          answer->set_value(std::string(msg.body(), msg.body_length()));
+        });
+    return answer->get_future();
+  }
+
+  //Closes the connection once the messages already written have been sent.
+  void close()
+  {
+    asio::post(io_context_,
+        [this]()
+        {
+          closing_ = true;
+          if (connected_ && write_msgs_.empty())
+            do_close();
+        });
+  }
+
+private:
+  static chat_message make_message(const std::string& body)
+  {
+    chat_message msg(body.length());
+    std::memcpy(msg.body(), body.data(), msg.body_length());
+    msg.encode_header();
+    return msg;
+  }
+
+  void queue(const chat_message& msg)
+  {
+    bool write_in_progress = !write_msgs_.empty();
+    write_msgs_.push_back(msg);
+    if (!write_in_progress && connected_)
+    {
+      do_write();
+    }
+  }
+
+  void do_close()
+  {
+    std::error_code ignored;
+    socket_.close(ignored);
+    if (closed_)
+      return;
+    closed_ = true;
+    requests_.clear();
+    if (close_handler_)
+      close_handler_();
+  }
+
+  void do_hello()
+  {
+    //Asking the server for the binary framing, it answers with a hello message.
+    asio::async_write(socket_,
+        asio::buffer(chat_message::hello(), chat_message::hello_length),
+        make_custom_alloc_handler(write_memory_,
+        [this](std::error_code ec, std::size_t /*length*/)
+        {
+          if (!ec)
+          {
+            connected_ = true;
+            if (!write_msgs_.empty())
+            {
+              do_write();
+            }
+            else if (closing_)
+            {
+              do_close();
+              return;
+            }
+            do_read_header();
+          }
+          else
+          {
+            do_close();
+          }
+        }));
+  }
+
+  void do_read_header()
+  {
+    asio::async_read(socket_,
+        asio::buffer(read_msg_.binary_header(), chat_message::binary_header_length),
+        make_custom_alloc_handler(read_memory_,
+        [this](std::error_code ec, std::size_t /*length*/)
+        {
+          if (!ec && read_msg_.decode_binary_header())
+          {
+            do_read_body();
+          }
+          else
+          {
+            do_close();
+          }
+        }));
+  }
+
+  void do_read_body()
+  {
+    asio::async_read(socket_,
+        asio::buffer(read_msg_.body(), read_msg_.body_length()),
+        make_custom_alloc_handler(read_memory_,
+        [this](std::error_code ec, std::size_t /*length*/)
+        {
+          if (ec)
+          {
+            do_close();
+            return;
+          }
+          if (read_msg_.type() == chat_message::ping_message)
+          {
+            chat_message pong;
+            pong.type(chat_message::pong_message);
+            pong.encode_header();
+            write(pong);
+          }
+          else if (read_msg_.type() == chat_message::text_message)
+          {
+            auto request = requests_.find(read_msg_.request_id());
+            if (read_msg_.request_id() != 0 && request != requests_.end())
+            {
+              response_handler handler = std::move(request->second);
+              requests_.erase(request);
+              handler(read_msg_);
+            }
+            else if (message_handler_)
+            {
+              message_handler_(read_msg_);
+            }
+          }
+          do_read_header();
+        }));
+  }
+
+  void do_write()
+  {
+    write_buffers_.clear();
+    for (const auto& msg: write_msgs_)
+    {
+      if (write_buffers_.size() + 2 > write_buffers_.capacity)
+        break;
+      write_buffers_.push_back(asio::buffer(msg.binary_header(),
+            chat_message::binary_header_length));
+      write_buffers_.push_back(asio::buffer(msg.body(), msg.body_length()));
+    }
+    asio::async_write(socket_, write_buffers_.buffers(),
+        make_custom_alloc_handler(write_memory_,
+        [this](std::error_code ec, std::size_t /*length*/)
+        {
+          if (!ec)
+          {
+            write_msgs_.erase(write_msgs_.begin(),
+                write_msgs_.begin() + write_buffers_.size() / 2);
+            if (!write_msgs_.empty())
+            {
+              do_write();
+            }
+            else if (closing_)
+            {
+              do_close();
+            }
+          }
+          else
+          {
+            do_close();
+          }
+        }));
+  }
+
+  asio::io_context& io_context_;
+  asio::ip::tcp::socket socket_;
+  chat_message read_msg_;
+  std::deque<chat_message> write_msgs_;
+  gather_buffers<2 * max_write_msgs> write_buffers_;
+  //Handler storage for the one read and the one write in flight.
+  handler_memory<256> read_memory_;
+  handler_memory<512> write_memory_;
+  bool connected_; //Set once the binary framing hello has been sent.
+  bool closing_; //Closes once the write queue is empty.
+  bool closed_;
+  std::uint32_t last_request_id_;
+  std::unordered_map<std::uint32_t, response_handler> requests_; //Waiting for an answer.
+  message_handler message_handler_;
+  close_handler close_handler_;
+};
+
+#endif // CHAT_CONNECTION_HPP
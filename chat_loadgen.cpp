@@ -0,0 +1,360 @@
+//
+// chat_loadgen.cpp
+// ~~~~~~~~~~~~~~~~
+//
+// Opens many connections to chat_server, fills rooms with them, sends
+// messages at a fixed rate and measures throughput and delivery latency.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "asio.hpp"
+#include "chat_connection.hpp"
+#include "chat_message.hpp"
+#include "io_context_pool.hpp"
+#include "server_metrics.hpp"
+
+using asio::ip::tcp;
+
+//----------------------------------------------------------------------
+
+std::uint64_t now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//----------------------------------------------------------------------
+
+struct loadgen_config
+{
+  std::size_t connections = 100;
+  std::vector<std::size_t> room_sizes = std::vector<std::size_t>(1, 10);
+  unsigned long first_room = 1000;
+  double rate = 1000; //Messages per second, over all connections.
+  std::size_t duration = 10; //Seconds.
+  std::size_t message_size = 64; //Bytes of body.
+  std::size_t threads = 1;
+};
+
+//What the clients in rooms of one size saw. Each shard keeps its own.
+struct room_stats
+{
+  room_stats()
+    : sent(0), expected(0), received(0), missed(0)
+  {
+  }
+
+  histogram latency; //Microseconds from sending to delivery.
+  std::uint64_t sent;
+  std::uint64_t expected; //Deliveries the sent messages should cause.
+  std::uint64_t received;
+  std::uint64_t missed; //Reported by the server's "You missed N messages."
+};
+
+/*
+  One simulated user: logs in with a nickname, joins its room and, once
+  told to, sends a message every interval. A message carries its send
+  time in place of the usual clock time ("name [<ns>] : text"), so every
+  member of the room can time its delivery.
+*/
+class load_client
+{
+public:
+  load_client(asio::io_context& io_context, std::string nickname,
+      unsigned long room, std::size_t room_size, room_stats& stats,
+      std::atomic<std::size_t>& joined)
+    : io_context_(io_context),
+      connection_(io_context),
+      timer_(io_context),
+      nickname_(nickname),
+      room_(room),
+      room_size_(room_size),
+      stats_(stats),
+      joined_(joined),
+      random_(std::hash<std::string>()(nickname)),
+      state_(logging_in),
+      window_start_(0),
+      window_end_(0)
+  {
+  }
+
+  void start(const tcp::resolver::results_type& endpoints)
+  {
+    connection_.on_message([this](const chat_message& msg) { handle(msg); });
+    connection_.connect(endpoints);
+    connection_.write(nickname_);
+  }
+
+  //Sends one message every interval between start and end (both in now_ns()).
+  void send_between(std::uint64_t start, std::uint64_t end,
+      std::chrono::nanoseconds interval, std::string padding)
+  {
+    asio::post(io_context_,
+        [=]()
+        {
+          window_start_ = start;
+          window_end_ = end;
+          interval_ = interval;
+          padding_ = padding;
+          //Spread the clients' sends over the interval. A client told late
+          //starts at once rather than waiting for a wrapped-around time.
+          std::uniform_int_distribution<std::int64_t> offset(0,
+              std::max<std::int64_t>(1, interval.count()) - 1);
+          std::int64_t wait = static_cast<std::int64_t>(start - now_ns()) + offset(random_);
+          timer_.expires_after(std::chrono::nanoseconds(std::max<std::int64_t>(0, wait)));
+          do_send();
+        });
+  }
+
+  void close()
+  {
+    connection_.close();
+  }
+
+private:
+  enum state { logging_in, joining, joined };
+
+  void handle(const chat_message& msg)
+  {
+    const char* body = msg.body();
+    std::size_t length = msg.body_length();
+    if (state_ == logging_in)
+    {
+      if (length >= 2 && body[0] == '~' && body[1] == '!') //The nickname is taken.
+      {
+        nickname_ += "_";
+        connection_.write("~" + nickname_);
+      }
+      else if (length >= 1 && body[0] == '~')
+      {
+        state_ = joining;
+        connection_.write("\\" + std::to_string(room_));
+      }
+      return;
+    }
+    if (state_ == joining)
+    {
+      //The answer to joining the room comes after the room's history.
+      if (length >= 1 && body[0] == '\\')
+      {
+        state_ = joined;
+        ++joined_;
+      }
+      return;
+    }
+
+    std::string text(body, length);
+    if (text.compare(0, 11, "You missed ") == 0)
+    {
+      stats_.missed += std::strtoull(text.c_str() + 11, 0, 10);
+      return;
+    }
+    std::string::size_type open = text.find(" [");
+    if (open == std::string::npos)
+      return;
+    std::uint64_t sent = std::strtoull(text.c_str() + open + 2, 0, 10);
+    if (sent >= window_start_ && sent < window_end_)
+    {
+      ++stats_.received;
+      stats_.latency.record((now_ns() - sent) / 1000);
+    }
+  }
+
+  void do_send()
+  {
+    timer_.async_wait(
+        [this](std::error_code ec)
+        {
+          std::uint64_t now = now_ns();
+          if (ec || now >= window_end_)
+            return;
+          connection_.write(nickname_ + " [" + std::to_string(now) + "] : " + padding_);
+          ++stats_.sent;
+          stats_.expected += room_size_;
+          timer_.expires_at(timer_.expiry() + interval_);
+          do_send();
+        });
+  }
+
+  asio::io_context& io_context_;
+  chat_connection connection_;
+  asio::steady_timer timer_;
+  std::string nickname_;
+  unsigned long room_;
+  std::size_t room_size_; //Clients actually in the room.
+  room_stats& stats_;
+  std::atomic<std::size_t>& joined_;
+  std::minstd_rand random_; //Each client's own, as clients run on several threads.
+  state state_;
+  std::uint64_t window_start_;
+  std::uint64_t window_end_;
+  std::chrono::nanoseconds interval_;
+  std::string padding_;
+};
+
+//----------------------------------------------------------------------
+
+std::vector<std::size_t> parse_sizes(const std::string& list)
+{
+  std::vector<std::size_t> sizes;
+  std::string::size_type pos = 0;
+  while (pos < list.size())
+  {
+    std::size_t size = std::atoi(list.c_str() + pos);
+    if (size > 0)
+      sizes.push_back(size);
+    pos = list.find(',', pos);
+    if (pos == std::string::npos)
+      break;
+    ++pos;
+  }
+  return sizes;
+}
+
+int main(int argc, char* argv[])
+{
+  try
+  {
+    loadgen_config config;
+    int first_arg = 1;
+    while (argc > first_arg + 2)
+    {
+      std::string option = argv[first_arg];
+      std::string value = argv[first_arg + 1];
+      if (option == "--connections" && std::atoi(value.c_str()) > 0)
+        config.connections = std::atoi(value.c_str());
+      else if (option == "--room-size" && !parse_sizes(value).empty())
+        config.room_sizes = parse_sizes(value);
+      else if (option == "--first-room")
+        config.first_room = std::strtoul(value.c_str(), 0, 10);
+      else if (option == "--rate" && std::atof(value.c_str()) > 0)
+        config.rate = std::atof(value.c_str());
+      else if (option == "--duration" && std::atoi(value.c_str()) > 0)
+        config.duration = std::atoi(value.c_str());
+      else if (option == "--size" && std::atoi(value.c_str()) > 0)
+        config.message_size = std::atoi(value.c_str());
+      else if (option == "--threads" && std::atoi(value.c_str()) > 0)
+        config.threads = std::atoi(value.c_str());
+      else
+        break;
+      first_arg += 2;
+    }
+
+    if (argc != first_arg + 2)
+    {
+      std::cerr << "Usage: chat_loadgen [--connections <n>] [--room-size <n>[,<n>...]]"
+        << " [--first-room <n>] [--rate <messages/s>] [--duration <seconds>]"
+        << " [--size <bytes>] [--threads <n>] <host> <port>\n";
+      return 1;
+    }
+
+    io_context_pool pool(config.threads);
+    tcp::resolver resolver(pool.get_io_context(0));
+    auto endpoints = resolver.resolve(argv[first_arg], argv[first_arg + 1]);
+
+    //stats[shard][i] covers the rooms of size config.room_sizes[i].
+    std::vector<std::vector<room_stats>> stats(config.threads,
+        std::vector<room_stats>(config.room_sizes.size()));
+    std::vector<std::size_t> rooms_per_size(config.room_sizes.size(), 0);
+    std::vector<std::size_t> clients_per_size(config.room_sizes.size(), 0);
+
+    //Rooms take the sizes in turn until every connection has one.
+    std::atomic<std::size_t> joined(0);
+    std::list<load_client> clients;
+    std::size_t assigned = 0;
+    for (unsigned long room = 0; assigned < config.connections; ++room)
+    {
+      std::size_t size_index = room % config.room_sizes.size();
+      std::size_t size = std::min(config.room_sizes[size_index],
+          config.connections - assigned);
+      ++rooms_per_size[size_index];
+      clients_per_size[size_index] += size;
+      for (std::size_t i = 0; i < size; ++i, ++assigned)
+      {
+        std::size_t shard = assigned % pool.size();
+        clients.emplace_back(pool.get_io_context(shard), "lg" + std::to_string(assigned),
+            config.first_room + room, size, stats[shard][size_index], joined);
+      }
+    }
+
+    std::thread runner([&pool](){ pool.run(); });
+    for (auto& client: clients)
+      client.start(endpoints);
+
+    //Wait for every client to be in its room before measuring anything.
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+    while (joined < config.connections && std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::cout << joined << " of " << config.connections << " connections joined their rooms.\n";
+
+    std::uint64_t start = now_ns() + 100000000; //Leaves 100 ms to tell every client.
+    std::uint64_t end = start + config.duration * 1000000000ull;
+    auto interval = std::chrono::nanoseconds(
+        static_cast<std::uint64_t>(1e9 * config.connections / config.rate));
+    std::string padding(config.message_size > 32 ? config.message_size - 32 : 1, 'x');
+    for (auto& client: clients)
+      client.send_between(start, end, interval, padding);
+
+    //Give the last messages a second to arrive.
+    std::int64_t left = static_cast<std::int64_t>(end - now_ns());
+    std::this_thread::sleep_for(std::chrono::nanoseconds(std::max<std::int64_t>(0, left))
+        + std::chrono::seconds(1));
+    for (auto& client: clients)
+      client.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    pool.stop();
+    runner.join();
+
+    room_stats total;
+    std::printf("%10s %7s %8s %10s %10s %8s %9s %9s %9s %9s\n", "room size",
+        "rooms", "clients", "sent", "delivered", "missed", "p50 us", "p99 us",
+        "p999 us", "max us");
+    for (std::size_t i = 0; i < config.room_sizes.size(); ++i)
+    {
+      room_stats group;
+      for (std::size_t shard = 0; shard < stats.size(); ++shard)
+      {
+        const room_stats& s = stats[shard][i];
+        group.latency.merge(s.latency);
+        group.sent += s.sent;
+        group.expected += s.expected;
+        group.received += s.received;
+        group.missed += s.missed;
+      }
+      std::printf("%10zu %7zu %8zu %10llu %10llu %8llu %9llu %9llu %9llu %9llu\n",
+          config.room_sizes[i], rooms_per_size[i], clients_per_size[i],
+          static_cast<unsigned long long>(group.sent),
+          static_cast<unsigned long long>(group.received),
+          static_cast<unsigned long long>(group.missed),
+          static_cast<unsigned long long>(group.latency.percentile(0.5)),
+          static_cast<unsigned long long>(group.latency.percentile(0.99)),
+          static_cast<unsigned long long>(group.latency.percentile(0.999)),
+          static_cast<unsigned long long>(group.latency.max));
+      total.sent += group.sent;
+      total.expected += group.expected;
+      total.received += group.received;
+    }
+    std::printf("Sent %.0f messages/s, delivered %.0f messages/s (%.2f%% of expected).\n",
+        total.sent / double(config.duration), total.received / double(config.duration),
+        total.expected ? 100.0 * total.received / total.expected : 0.0);
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+  }
+
+  return 0;
+}
@@ -11,31 +11,139 @@
 #ifndef CHAT_MESSAGE_HPP
 #define CHAT_MESSAGE_HPP
 
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <utility>
+#include "buffer_pool.hpp"
 
+/*
+  A chat message can travel in one of two framings:
 
+    text    The original 4 character ASCII header holding the body length
+            ("%4d"), followed by the body.
+    binary  An 8 byte header: the body length as a little-endian 32 bit
+            integer, a message type byte and a little-endian 24 bit request
+            id, followed by the body.
+
+  Every connection starts in the text framing. A client wanting the binary
+  framing opens the connection with the 4 byte hello magic instead of a text
+  header; the server answers with a binary hello_message and from then on
+  both sides use the binary framing, in which the server also pings idle
+  clients with empty ping_messages. A client may number a command with a
+  request id and the server answers it with the same id, so several
+  commands can be waited on at once; id 0 is a message that is neither a
+  request nor an answer, and the text framing cannot carry ids. Both headers are encoded for every
+  message so the same message can be sent on connections of either framing.
+
+  The storage of a message is a single pooled buffer sized to its body:
+
+    [binary header (8)][text header (4)][body]
+
+  so data() (text header and body) is contiguous and a short message only
+  takes a small buffer from the buffer_pool. A message can also borrow
+  storage with this layout from elsewhere (a mapped log file, say) instead
+  of owning a pooled buffer.
+*/
 class chat_message
 {
 public:
   enum { header_length = 4 };
+  enum { binary_header_length = 8 };
+  enum { hello_length = 4 };
   enum { max_body_length = 512 };
+  enum { max_request_id = 0xffffff };
+
+  enum framing { text_framing, binary_framing };
+
+  enum message_type
+  {
+    text_message = 0,
+    hello_message = 1,
+    ping_message = 2, //Asks the other side to answer with a pong_message.
+    pong_message = 3
+  };
+
+  explicit chat_message(std::size_t length = 0)
+    : buffer_(0),
+      size_class_(0),
+      body_length_(0),
+      type_(text_message),
+      request_id_(0)
+  {
+    body_length(length);
+  }
+
+  chat_message(const chat_message& other)
+    : buffer_(0),
+      size_class_(0),
+      body_length_(other.body_length_),
+      type_(other.type_),
+      request_id_(other.request_id_)
+  {
+    allocate(body_length_);
+    if (other.buffer_)
+      std::memcpy(buffer_, other.buffer_, storage_header_length + body_length_);
+    else //Moved from, so copied as an empty message.
+      std::memset(buffer_, 0, storage_header_length);
+  }
+
+  chat_message(chat_message&& other)
+    : buffer_(other.buffer_),
+      size_class_(other.size_class_),
+      body_length_(other.body_length_),
+      type_(other.type_),
+      request_id_(other.request_id_)
+  {
+    other.buffer_ = 0;
+    other.body_length_ = 0;
+  }
+
+  chat_message& operator=(chat_message other)
+  {
+    std::swap(buffer_, other.buffer_);
+    std::swap(size_class_, other.size_class_);
+    std::swap(body_length_, other.body_length_);
+    std::swap(type_, other.type_);
+    std::swap(request_id_, other.request_id_);
+    return *this;
+  }
+
+  ~chat_message()
+  {
+    if (buffer_ && size_class_ != borrowed_storage)
+      buffer_pool::deallocate(buffer_, size_class_);
+  }
+
+  //A message using storage laid out as above, with both headers encoded.
+  //The owner must keep the storage alive and unchanged for the message's
+  //lifetime; the message itself must not be resized.
+  static chat_message borrowed(char* storage, std::size_t length,
+      message_type type)
+  {
+    return chat_message(storage, length, type);
+  }
+
+  //The magic a client sends in place of its first text header.
+  static const char* hello()
+  {
+    return "SCB\x01";
+  }
 
-  chat_message()
-    : body_length_(0)
+  static bool is_hello(const char* header)
   {
-    strcpy(data_,"");
+    return std::memcmp(header, hello(), hello_length) == 0;
   }
 
   const char* data() const
   {
-    return data_;
+    return buffer_ + binary_header_length;
   }
 
   char* data()
   {
-    return data_;
+    return buffer_ + binary_header_length;
   }
 
   std::size_t length() const
@@ -43,14 +151,24 @@ public:
     return header_length + body_length_;
   }
 
+  const char* binary_header() const
+  {
+    return buffer_;
+  }
+
+  char* binary_header()
+  {
+    return buffer_;
+  }
+
   const char* body() const
   {
-    return data_ + header_length;
+    return buffer_ + storage_header_length;
   }
 
   char* body()
   {
-    return data_ + header_length;
+    return buffer_ + storage_header_length;
   }
 
   std::size_t body_length() const
@@ -58,36 +176,143 @@ public:
     return body_length_;
   }
 
+  //Grows the storage when needed; the headers are kept, the body is not.
   void body_length(std::size_t new_length)
   {
     body_length_ = new_length;
     if (body_length_ > max_body_length)
       body_length_ = max_body_length;
+    reserve(body_length_);
+  }
+
+  message_type type() const
+  {
+    return type_;
+  }
+
+  void type(message_type new_type)
+  {
+    type_ = new_type;
+  }
+
+  //The request this message is or answers, 0 for none.
+  std::uint32_t request_id() const
+  {
+    return request_id_;
+  }
+
+  void request_id(std::uint32_t id)
+  {
+    request_id_ = id & max_request_id;
   }
 
   bool decode_header()
   {
-    char header[header_length + 1] = "";
-    std::strncat(header, data_, header_length);
-    body_length_ = std::atoi(header);
+    //Same as atoi on the 4 characters: leading spaces, then digits.
+    const char* header = data();
+    std::size_t i = 0;
+    while (i < header_length && header[i] == ' ')
+      ++i;
+    body_length_ = 0;
+    for (; i < header_length && header[i] >= '0' && header[i] <= '9'; ++i)
+      body_length_ = body_length_ * 10 + (header[i] - '0');
+    type_ = text_message;
+    request_id_ = 0;
     if (body_length_ > max_body_length)
     {
       body_length_ = 0;
       return false;
     }
+    reserve(body_length_);
+    return true;
+  }
+
+  bool decode_binary_header()
+  {
+    const unsigned char* header =
+      reinterpret_cast<const unsigned char*>(binary_header());
+    body_length_ = static_cast<std::size_t>(header[0])
+      | static_cast<std::size_t>(header[1]) << 8
+      | static_cast<std::size_t>(header[2]) << 16
+      | static_cast<std::size_t>(header[3]) << 24;
+    type_ = static_cast<message_type>(header[4]);
+    request_id_ = static_cast<std::uint32_t>(header[5])
+      | static_cast<std::uint32_t>(header[6]) << 8
+      | static_cast<std::uint32_t>(header[7]) << 16;
+    if (body_length_ > max_body_length)
+    {
+      body_length_ = 0;
+      return false;
+    }
+    reserve(body_length_);
     return true;
   }
 
   void encode_header()
   {
-    char header[header_length + 1] = "";
-    std::sprintf(header, "%4d", static_cast<int>(body_length_));
-    std::memcpy(data_, header, header_length);
+    //Right aligned decimal, as "%4d" would print it.
+    char* header = data();
+    std::size_t n = body_length_;
+    for (int i = header_length - 1; i >= 0; --i)
+    {
+      header[i] = (n != 0 || i == header_length - 1) ? '0' + n % 10 : ' ';
+      n /= 10;
+    }
+
+    header = binary_header();
+    header[0] = static_cast<char>(body_length_ & 0xff);
+    header[1] = static_cast<char>((body_length_ >> 8) & 0xff);
+    header[2] = static_cast<char>((body_length_ >> 16) & 0xff);
+    header[3] = static_cast<char>((body_length_ >> 24) & 0xff);
+    header[4] = static_cast<char>(type_);
+    header[5] = static_cast<char>(request_id_ & 0xff);
+    header[6] = static_cast<char>((request_id_ >> 8) & 0xff);
+    header[7] = static_cast<char>((request_id_ >> 16) & 0xff);
   }
 
 private:
-  char data_[header_length + max_body_length];
+  enum { storage_header_length = binary_header_length + header_length };
+  static const std::size_t borrowed_storage = static_cast<std::size_t>(-1);
+
+  chat_message(char* storage, std::size_t length, message_type type)
+    : buffer_(storage),
+      size_class_(borrowed_storage),
+      body_length_(length),
+      type_(type),
+      request_id_(0)
+  {
+  }
+
+  void allocate(std::size_t length)
+  {
+    size_class_ = buffer_pool::size_class(storage_header_length + length);
+    buffer_ = buffer_pool::allocate(size_class_);
+  }
+
+  void reserve(std::size_t length)
+  {
+    if (buffer_ && size_class_ != borrowed_storage
+        && storage_header_length + length <= buffer_pool::class_size(size_class_))
+      return;
+
+    char* old_buffer = buffer_;
+    std::size_t old_size_class = size_class_;
+    allocate(length);
+    if (old_buffer)
+    {
+      std::memcpy(buffer_, old_buffer, storage_header_length);
+      if (old_size_class != borrowed_storage)
+        buffer_pool::deallocate(old_buffer, old_size_class);
+    }
+    else
+      std::memset(buffer_, 0, storage_header_length);
+  }
+
+  char* buffer_;
+  std::size_t size_class_;
   std::size_t body_length_;
+  message_type type_;
+  std::uint32_t request_id_;
 };
 
 
@@ -0,0 +1,438 @@
+//
+// chat_room.hpp
+// ~~~~~~~~~~~~~
+//
+// A chatroom of the server and the participants it delivers messages to.
+//
+
+#ifndef CHAT_ROOM_HPP
+#define CHAT_ROOM_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "asio.hpp"
+#include "chat_message.hpp"
+#include "history_ring.hpp"
+#include "message_log.hpp"
+#include "server_metrics.hpp"
+#include "space_saving.hpp"
+
+//----------------------------------------------------------------------
+
+//A broadcast frame is built once and shared, read-only, by every recipient.
+typedef std::shared_ptr<const chat_message> chat_message_ptr;
+typedef std::deque<chat_message_ptr> chat_message_queue;
+
+//Rooms and sessions serialise their own handlers, so a shard may be run by many threads.
+typedef asio::strand<asio::io_context::executor_type> strand_type;
+
+//----------------------------------------------------------------------
+
+inline chat_message_ptr string_to_msg(const std::string& n,
+    chat_message::message_type type = chat_message::text_message,
+    std::uint32_t request_id = 0)
+{
+    //Function to convert a string to a shared chat message.
+    auto msg1 = std::make_shared<chat_message>(n.length());
+    msg1->type(type);
+    msg1->request_id(request_id);
+    std::memcpy(msg1->body(), n.data(), msg1->body_length());
+    msg1->encode_header();
+    return msg1;
+}
+
+
+
+class chat_participant
+{
+  private:
+    std::string nickname;
+  public:
+    virtual ~chat_participant() {}
+    virtual void deliver(const chat_message_ptr& msg) = 0;
+    //Queues several messages at once, so they can leave in one write.
+    virtual void deliver(std::vector<chat_message_ptr> msgs) = 0;
+    //Messages and bytes waiting to be sent; safe to call from any thread.
+    virtual std::size_t queued_msgs() const { return 0; }
+    virtual std::size_t queued_bytes() const { return 0; }
+    void set_nickname(std::string n)
+    {
+      nickname = n;
+    }
+    std::string get_nickname()
+    {
+      return nickname;
+    }
+};
+
+//How many replies a TOP request is answered with.
+enum { num_top_replies = 10 };
+
+//Answers a TOP request: "[]TOP:" followed by one "count reply" line per reply.
+inline chat_message_ptr top_replies_msg(const std::vector<space_saving::item>& top,
+    std::uint32_t request_id)
+{
+  std::string result = "[]TOP:";
+  for (const auto& reply: top)
+    result += "\n\t" + std::to_string(reply.count) + "      " + reply.value;
+  return string_to_msg(result, chat_message::text_message, request_id);
+}
+
+typedef std::shared_ptr<chat_participant> chat_participant_ptr;
+
+//----------------------------------------------------------------------
+
+//Limits how many message logs the rooms of a server hold open at once, and
+//so the file descriptors they hold, one each.
+class log_budget
+{
+public:
+  explicit log_budget(std::size_t limit)
+    : limit_(limit),
+      open_(0)
+  {
+  }
+
+  //Returns false when the limit has been reached.
+  bool acquire()
+  {
+    std::size_t n = open_.load(std::memory_order_relaxed);
+    do
+    {
+      if (n >= limit_)
+        return false;
+    }
+    while (!open_.compare_exchange_weak(n, n + 1, std::memory_order_relaxed));
+    return true;
+  }
+
+  void release()
+  {
+    open_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  std::size_t open() const
+  {
+    return open_.load(std::memory_order_relaxed);
+  }
+
+private:
+  const std::size_t limit_;
+  std::atomic<std::size_t> open_;
+};
+
+//----------------------------------------------------------------------
+
+/*
+  A chat_room is owned by exactly one shard of the io_context_pool. Every
+  change to its participants and recent messages runs on the room's strand,
+  so sessions hand their requests over with dispatch. Busy rooms never block
+  each other even when the shard is run by several threads.
+*/
+class chat_room
+{
+public:
+  explicit chat_room(asio::io_context& io_context)
+    : executor_(io_context.get_executor()),
+      num_of_participants_(0),
+      num_of_messages_(0),
+      sampled_messages_(0),
+      message_rate_(0),
+      recent_msgs_(max_recent_msgs),
+      log_segment_size_(0),
+      log_segments_(0),
+      log_budget_(0),
+      log_worker_(0),
+      log_refused_(false),
+      replies_(max_reply_counters)
+  {
+  }
+
+  int num_of_participants()
+  {
+    return num_of_participants_;
+  }
+
+  //Messages delivered to the room since it was created.
+  std::uint64_t num_of_messages() const
+  {
+    return num_of_messages_.load(std::memory_order_relaxed);
+  }
+
+  //Counts the messages since the previous sample, seconds ago, as the
+  //room's current rate. Only one thread may take samples.
+  void sample_rate(double seconds)
+  {
+    std::uint64_t messages = num_of_messages();
+    message_rate_.store((messages - sampled_messages_) / seconds,
+        std::memory_order_relaxed);
+    sampled_messages_ = messages;
+  }
+
+  //Messages per second, as of the latest sample.
+  double message_rate() const
+  {
+    return message_rate_.load(std::memory_order_relaxed);
+  }
+
+  void clear_messages()
+  {
+    asio::dispatch(executor_,
+        [this]()
+        {
+          //clearing the list of recent messages.
+          recent_msgs_.clear();
+        });
+  }
+
+  void join(chat_participant_ptr participant)
+  {
+    asio::dispatch(executor_,
+        [this, participant]()
+        {
+          do_join(participant);
+        });
+  }
+
+  //Joins the room and tells the participant whether the room had a name,
+  //answering request_id.
+  void change_to(chat_participant_ptr participant, std::uint32_t request_id)
+  {
+    asio::dispatch(executor_,
+        [this, participant, request_id]()
+        {
+          std::string current = get_chatname();
+          do_join(participant);
+          if(current == "NULL") //The chatroom specified does not exist.
+            participant->deliver(string_to_msg("\\\\",
+                  chat_message::text_message, request_id));
+          else
+            participant->deliver(string_to_msg("\\"+current,
+                  chat_message::text_message, request_id));
+        });
+  }
+
+  //Deletes the room if nobody is inside it and reports back to the requester.
+  //on_removed runs on the room's strand once the room has been deleted.
+  void remove(chat_participant_ptr requester, std::uint32_t request_id,
+      std::function<void()> on_removed)
+  {
+    asio::dispatch(executor_,
+        [this, requester, request_id, on_removed]()
+        {
+          if(get_chatname() == "NULL" || !participants_.empty())
+            requester->deliver(string_to_msg("*!", chat_message::text_message,
+                  request_id));
+          else
+          {
+            set_chatname("NULL");
+            recent_msgs_.clear();
+            close_log();
+            if (log_budget_)
+              message_log::remove(log_path_);
+            replies_.clear();
+            on_removed();
+            requester->deliver(string_to_msg("**", chat_message::text_message,
+                  request_id));
+          }
+        });
+  }
+
+  /*
+    Keeps every message of the room in the log at path, and restores the
+    recent messages from it if it exists. The log is only held open while
+    the room has participants: it is opened for the first message sent to
+    them and closed when the last participant leaves, so rooms that are
+    merely visited cost neither a mapping nor a file. When budget has no room for
+    another open log, messages go unlogged until it has. New segments are
+    created ahead of time on worker.
+  */
+  void set_log(std::string path, std::size_t segment_size, std::size_t max_segments,
+      log_budget& budget, log_worker& worker)
+  {
+    asio::dispatch(executor_,
+        [this, path, segment_size, max_segments, &budget, &worker]()
+        {
+          log_path_ = path;
+          log_segment_size_ = segment_size;
+          log_segments_ = max_segments;
+          log_budget_ = &budget;
+          log_worker_ = &worker;
+          if (!message_log::exists(path))
+            return;
+          message_log log(path, segment_size, max_segments);
+          if (!log.open())
+          {
+            std::cerr<<"Could not open the message log in "<<path<<".\n";
+            return;
+          }
+          std::vector<chat_message_ptr> backlog;
+          std::uint64_t end = log.end();
+          log.read(end > max_recent_msgs ? end - max_recent_msgs : 0,
+              max_recent_msgs, backlog);
+          //Copied, so the closed log's segments are not kept mapped.
+          for (const auto& msg: backlog)
+            recent_msgs_.push(std::make_shared<chat_message>(*msg));
+        });
+  }
+
+  //Counts a reply sent in this room.
+  void add_reply(std::string reply)
+  {
+    asio::dispatch(executor_,
+        [this, reply]()
+        {
+          replies_.add(reply);
+        });
+  }
+
+  //Sends the requester the room's most frequent replies.
+  void top_replies(chat_participant_ptr requester, std::uint32_t request_id)
+  {
+    asio::dispatch(executor_,
+        [this, requester, request_id]()
+        {
+          requester->deliver(top_replies_msg(replies_.top(num_top_replies),
+                request_id));
+        });
+  }
+
+  void join_message(std::string str)
+  {
+    str = str + " has joined the chat.";
+    deliver(string_to_msg(str));
+  }
+
+  void exit_message(std::string str)
+  {
+    str = str + " has left the chat.";
+    deliver(string_to_msg(str));
+  }
+
+  void leave(chat_participant_ptr participant)
+  {
+    //Posted, since a participant may leave from inside its own deliver while
+    //the room is still walking its participants.
+    asio::post(executor_,
+        [this, participant]()
+        {
+          participants_.erase(participant);
+          num_of_participants_ = participants_.size();
+          exit_message(participant->get_nickname());
+          if (participants_.empty())
+            close_log();
+        });
+  }
+
+  void set_chatname(std::string str)
+  {
+    std::lock_guard<std::mutex> lock(name_mutex_);
+    chat_room_name = str;
+  }
+
+  std::string get_chatname()
+  {
+    std::lock_guard<std::mutex> lock(name_mutex_);
+    return chat_room_name;
+  }
+
+  void deliver(const chat_message_ptr& msg)
+  {
+    asio::dispatch(executor_,
+        [this, msg]()
+        {
+          recent_msgs_.push(msg);
+          //Notices to an empty room, like its last participant leaving, are not logged.
+          if (!log_ && !participants_.empty())
+            open_log();
+          if (log_)
+            log_->append(*msg);
+          num_of_messages_.fetch_add(1, std::memory_order_relaxed);
+          server_metrics::fan_out().record(participants_.size());
+
+          //Every recipient only takes another reference to the same frame,
+          //though a session also takes its inbox mutex to queue it.
+          for (const auto& participant: participants_)
+            participant->deliver(msg);
+        });
+  }
+
+private:
+  void open_log()
+  {
+    if (!log_budget_)
+      return;
+    if (!log_budget_->acquire())
+    {
+      if (!log_refused_)
+        std::cerr<<"Too many open message logs, not logging "<<log_path_<<".\n";
+      log_refused_ = true;
+      return;
+    }
+    log_.reset(new message_log(log_path_, log_segment_size_, log_segments_,
+          log_worker_));
+    if (!log_->open())
+    {
+      std::cerr<<"Could not open the message log in "<<log_path_<<".\n";
+      log_.reset();
+      log_budget_->release();
+      return;
+    }
+    log_refused_ = false;
+  }
+
+  void close_log()
+  {
+    if (!log_)
+      return;
+    log_.reset();
+    log_budget_->release();
+  }
+
+  void do_join(chat_participant_ptr participant)
+  {
+    participants_.insert(participant);
+    num_of_participants_ = participants_.size();
+    //The whole backlog is handed over at once.
+    if (recent_msgs_.size() > 0)
+    {
+      std::vector<chat_message_ptr> backlog;
+      recent_msgs_.copy_to(backlog);
+      participant->deliver(std::move(backlog));
+    }
+  }
+
+  strand_type executor_;
+  std::set<chat_participant_ptr> participants_;
+  std::atomic<int> num_of_participants_;
+  std::atomic<std::uint64_t> num_of_messages_;
+  std::uint64_t sampled_messages_;
+  std::atomic<double> message_rate_;
+  enum { max_recent_msgs = 100 };
+  history_ring<chat_message_ptr> recent_msgs_;
+  std::unique_ptr<message_log> log_; //Open while the room has participants.
+  std::string log_path_;
+  std::size_t log_segment_size_;
+  std::size_t log_segments_;
+  log_budget* log_budget_; //Null when the room keeps no log.
+  log_worker* log_worker_;
+  bool log_refused_; //The budget was spent the last time the log was opened.
+  enum { max_reply_counters = 100 };
+  space_saving replies_;
+  std::mutex name_mutex_;
+  std::string chat_room_name;
+};
+
+typedef std::shared_ptr<chat_room> chat_room_ptr;
+
+#endif // CHAT_ROOM_HPP
@@ -8,139 +8,405 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
+#include <cstdio>
 #include <cstdlib>
 #include <deque>
+#include <new>
 #include <iostream>
+#include <functional>
 #include <list>
+#include <map>
 #include <memory>
 #include <set>
 #include <utility>
 #include "asio.hpp"
 #include "chat_message.hpp"
+#include "chat_room.hpp"
 #include <vector>
 #include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <sstream>
+#include <unordered_map>
+#include <unistd.h>
+#include "gather_buffers.hpp"
+#include "handler_memory.hpp"
+#include "io_context_pool.hpp"
+#include "nickname_registry.hpp"
+#include "reply_counter.hpp"
+#include "server_metrics.hpp"
+#include "space_saving.hpp"
+#include "timing_wheel.hpp"
+#include "ring_buffer.hpp"
 
-std::string client_name;
 using asio::ip::tcp;
 
 //----------------------------------------------------------------------
 
-typedef std::deque<chat_message> chat_message_queue;
+//Sessions on every shard share the registry of nicknames.
+nickname_registry<chat_participant> names;
+//How often each reply was sent, kept in ~.SuperChat.txt.
+reply_counter common_replies;
 
-//----------------------------------------------------------------------
-
-chat_message string_to_msg(std::string n)
+/*
+  The most frequent replies over all rooms, estimated in bounded memory.
+  Each shard counts the replies of its own sessions in a summary of its
+  own, an asio service of its io_context, so counting never takes a lock
+  shared with other shards; the mutex is only contended when a shard runs
+  on several threads. "TOP *" reads the summaries of every shard merged
+  into one, which is merged again at most once every refresh_ms.
+*/
+class shard_replies
+  : public asio::execution_context::service
 {
-    //Function to convert a string to a chat message.
-    char name[n.length()+ 1];
-    strcpy(name, n.c_str());
-    chat_message msg1;
-    msg1.body_length(std::strlen(name));
-    std::memcpy(msg1.body(), name, msg1.body_length());
-    msg1.encode_header();
-    return msg1;
-}
+public:
+  static asio::execution_context::id id;
 
+  enum { capacity = 1000 };
+  enum { refresh_ms = 1000 };
 
+  explicit shard_replies(asio::io_context& io_context)
+    : asio::execution_context::service(io_context),
+      top_(capacity)
+  {
+    std::lock_guard<std::mutex> lock(shards_mutex());
+    shards().push_back(this);
+  }
 
-class chat_participant
-{
-  private:
-    std::string nickname;
-  public:
-    virtual ~chat_participant() {}
-    virtual void deliver(const chat_message& msg) = 0;
-    void set_nickname(std::string n)
+  ~shard_replies()
+  {
+    std::lock_guard<std::mutex> lock(shards_mutex());
+    shards().erase(std::find(shards().begin(), shards().end(), this));
+  }
+
+  void add(const std::string& reply)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    top_.add(reply);
+  }
+
+  //The k highest counts over every shard, as merged at most refresh_ms ago.
+  static std::vector<space_saving::item> top(std::size_t k)
+  {
+    merged_top& merged = merged_top::get();
+    std::lock_guard<std::mutex> lock(merged.mutex);
+    auto now = std::chrono::steady_clock::now();
+    if (now >= merged.next_refresh)
     {
-      nickname = n;
+      merged.summary.clear();
+      {
+        std::lock_guard<std::mutex> shards_lock(shards_mutex());
+        for (shard_replies* shard: shards())
+        {
+          std::lock_guard<std::mutex> shard_lock(shard->mutex_);
+          merged.summary.merge(shard->top_);
+        }
+      }
+      merged.top = merged.summary.top(num_top_replies);
+      merged.next_refresh = now + std::chrono::milliseconds(refresh_ms);
     }
-    std::string get_nickname()
+    return std::vector<space_saving::item>(merged.top.begin(),
+        merged.top.begin() + std::min(k, merged.top.size()));
+  }
+
+private:
+  //The shards' summaries as last merged, shared by every "TOP *".
+  struct merged_top
+  {
+    merged_top()
+      : summary(capacity)
     {
-      return nickname;
     }
-};
 
-std::vector<std::string> names;
+    static merged_top& get()
+    {
+      static merged_top merged;
+      return merged;
+    }
 
-typedef std::shared_ptr<chat_participant> chat_participant_ptr;
+    std::mutex mutex;
+    space_saving summary;
+    std::vector<space_saving::item> top; //The first num_top_replies.
+    std::chrono::steady_clock::time_point next_refresh;
+  };
 
-//----------------------------------------------------------------------
+  void shutdown()
+  {
+  }
 
-void on_quit(std::string name)
-{
-  for(int i=0;i< (int)names.size();i++)
+  static std::vector<shard_replies*>& shards()
   {
-    if(names[i] == name)
-    {
-      std::cout<<"Erased "<<names[i]<<" from the list of Nicknames.\n";
-      names.erase(names.begin()+i);
-    }
+    static std::vector<shard_replies*> shards;
+    return shards;
   }
+
+  static std::mutex& shards_mutex()
+  {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  std::mutex mutex_;
+  space_saving top_;
+};
+
+asio::execution_context::id shard_replies::id;
+asio::execution_context::id timing_wheel::id;
+
+//----------------------------------------------------------------------
+
+void on_quit(const chat_participant_ptr& participant)
+{
+  std::string name = participant->get_nickname();
+  if(names.erase(name, participant.get()))
+    std::cout<<"Erased "<<name<<" from the list of Nicknames.\n";
 }
 
-class chat_room
+//----------------------------------------------------------------------
+
+//Settings for the rooms of a server.
+struct room_config
+{
+  std::size_t max_rooms = 100000;
+
+  //Where rooms keep their message logs; no logs are kept when empty.
+  std::string log_dir;
+  std::size_t log_segment_size = 1024 * 1024;
+  std::size_t log_segments = 16; //Per room; older segments are deleted.
+  std::size_t max_open_logs = 1000; //Per port, held by rooms with participants.
+};
+
+/*
+  Rooms are looked up by number in a hash map and created the first time
+  somebody joins them, on the shard picked by their number. A room is never
+  destroyed while the server runs; deleting it only clears its name and
+  history, so a session can never be left in a room the registry has
+  forgotten. Named rooms are also kept in an ordered index which the room
+  listing walks one page at a time.
+
+  When rooms keep logs, the named rooms are also written to a "rooms" file
+  next to the logs, one "<number> <name>" per line, whenever a name changes.
+  A restarted server creates them again from it, so a room keeps its name
+  as well as its history.
+*/
+class room_registry
 {
 public:
-  int num_of_participants()
+  typedef unsigned long room_id;
+
+  enum { page_size = 20 };
+
+  //Rooms keep their message logs under log_path, unless it is empty.
+  room_registry(io_context_pool& pool, const room_config& config,
+      const std::string& log_path)
+    : pool_(pool),
+      config_(config),
+      log_path_(log_path),
+      rooms_path_(log_path.empty() ? std::string() : log_path + "/rooms"),
+      logs_(config.max_open_logs),
+      log_worker_(log_path.empty() ? 0 : new log_worker)
   {
-    return participants_.size();
+    load();
   }
-  void clear_messages()
+
+  //Parses a room number of at most 9 digits.
+  static bool parse_id(const std::string& str, room_id& id)
   {
-    //clearing the list of recent messages.
-    recent_msgs_.clear();
+    if(str.empty() || str.size() > 9
+        || str.find_first_not_of("0123456789") != std::string::npos)
+      return false;
+    id = std::strtoul(str.c_str(), 0, 10);
+    return true;
   }
-  void join(chat_participant_ptr participant)
+
+  chat_room_ptr find(room_id id)
   {
-    participants_.insert(participant);
-    for (auto msg: recent_msgs_)
-      participant->deliver(msg);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = rooms_.find(id);
+    return it == rooms_.end() ? chat_room_ptr() : it->second;
   }
-  void join_message(std::string str)
+
+  //Returns null when the room does not exist and the registry is full.
+  chat_room_ptr get_or_create(room_id id)
   {
-    str = str + " has joined the chat.";
-    chat_message msg1 = string_to_msg(str);
-    deliver(msg1);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = rooms_.find(id);
+    if(it != rooms_.end())
+      return it->second;
+    if(rooms_.size() >= config_.max_rooms)
+      return chat_room_ptr();
+
+    auto room = std::make_shared<chat_room>(pool_.get_io_context(id));
+    room->set_chatname("NULL");
+    if(!log_path_.empty())
+      room->set_log(log_path_ + "/" + std::to_string(id),
+          config_.log_segment_size, config_.log_segments, logs_, *log_worker_);
+    rooms_.emplace(id, room);
+    return room;
   }
 
-  void exit_message(std::string str)
+  void set_chatname(room_id id, const std::string& name)
   {
-    str = str + " has left the chat.";
-    chat_message msg1 = string_to_msg(str);
-    deliver(msg1);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = rooms_.find(id);
+    if(it == rooms_.end())
+      return;
+    it->second->set_chatname(name);
+    if(name == "NULL")
+      named_.erase(id);
+    else
+      named_[id] = name;
+    save();
   }
 
-  void leave(chat_participant_ptr participant)
+  //Deletes the room if it exists and is empty, answering the requester.
+  void remove(room_id id, chat_participant_ptr requester, std::uint32_t request_id)
   {
-    participants_.erase(participant);
-    exit_message(participant->get_nickname());
+    chat_room_ptr room = find(id);
+    if(!room)
+    {
+      requester->deliver(string_to_msg("*!", chat_message::text_message, request_id));
+      return;
+    }
+    room->remove(requester, request_id,
+        [this, id]()
+        {
+          std::cout<<"Deleted Chatroom number "<<id<<".\n";
+          std::lock_guard<std::mutex> lock(mutex_);
+          named_.erase(id);
+          save();
+        });
   }
 
-  void set_chatname(std::string str)
+  //One page of named rooms, starting at the first number not below from.
+  //When more rooms follow, the page ends with ">>more:" and the next number.
+  std::string list(room_id from)
   {
-    chat_room_name = str;
+    std::string result = "[]LOR:Number    Name of Chatroom";
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = named_.lower_bound(from);
+    for(int i = 0; i < page_size && it != named_.end(); ++i, ++it)
+      result += "\n\t     " + std::to_string(it->first) + "      " + it->second;
+    if(it != named_.end())
+      result += "\n\t>>more:" + std::to_string(it->first);
+    return result;
   }
 
-  std::string get_chatname()
+  //Calls f(id, room) for every room, holding the registry's lock.
+  template <typename Function>
+  void for_each(Function f)
   {
-    return chat_room_name;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for(const auto& entry: rooms_)
+      f(entry.first, entry.second);
   }
 
-  void deliver(const chat_message& msg)
+private:
+  //Creates the named rooms a previous run saved.
+  void load()
   {
-    recent_msgs_.push_back(msg);
-    while (recent_msgs_.size() > max_recent_msgs)
-      recent_msgs_.pop_front();
+    if(rooms_path_.empty())
+      return;
+    std::ifstream file(rooms_path_.c_str());
+    std::string line;
+    while(std::getline(file, line))
+    {
+      std::string::size_type space = line.find(' ');
+      room_id id;
+      if(space == std::string::npos || !parse_id(line.substr(0, space), id))
+        continue;
+      chat_room_ptr room = get_or_create(id);
+      if(!room)
+        break;
+      room->set_chatname(line.substr(space + 1));
+      std::lock_guard<std::mutex> lock(mutex_);
+      named_[id] = line.substr(space + 1);
+    }
+  }
 
-    for (auto participant: participants_)
-      participant->deliver(msg);
+  //Writes the named rooms out, replacing the file by rename so it is never
+  //seen half written. Called with mutex_ held.
+  void save()
+  {
+    if(rooms_path_.empty() || !message_log::make_directory(log_path_))
+      return;
+    std::string new_path = rooms_path_ + ".new";
+    {
+      std::ofstream file(new_path.c_str(), std::ofstream::trunc);
+      for(const auto& entry: named_)
+        file << entry.first << ' ' << entry.second << '\n';
+    }
+    std::rename(new_path.c_str(), rooms_path_.c_str());
   }
 
-private:
-  std::set<chat_participant_ptr> participants_;
-  enum { max_recent_msgs = 100 };
-  chat_message_queue recent_msgs_;
-  std::string chat_room_name;
+  io_context_pool& pool_;
+  const room_config& config_;
+  std::string log_path_;
+  std::string rooms_path_; //Empty when rooms keep no logs.
+  log_budget logs_;
+  std::unique_ptr<log_worker> log_worker_; //Creates the rooms' log segments.
+  std::mutex mutex_;
+  std::unordered_map<room_id, chat_room_ptr> rooms_;
+  std::map<room_id, std::string> named_;
+};
+
+//----------------------------------------------------------------------
+
+//What a session does with a client that lets its write queue fill up.
+enum slow_consumer_policy
+{
+  drop_oldest,  //Forget the oldest queued messages.
+  disconnect,   //Close the connection.
+  collapse      //Replace the queued messages with a "missed N messages" notice.
+};
+
+//Settings every session of a server is started with.
+struct session_config
+{
+  //Upper bounds on what a single gather write may flush from the write queue.
+  //The buffers are held in fixed storage of write_buffer_capacity per session.
+  enum { write_buffer_capacity = 128 };
+  std::size_t max_write_buffers = 64;
+  std::size_t max_write_bytes = 64 * 1024;
+
+  //Bytes buffered per session for reads, never less than one full frame.
+  std::size_t read_buffer_size = 4096;
+
+  //Limits on the messages waiting to be written to one client.
+  std::size_t max_queue_msgs = 10000;
+  std::size_t max_queue_bytes = 4 * 1024 * 1024;
+  slow_consumer_policy slow_policy = collapse;
+
+  //Seconds of silence after which a binary framing client is pinged, and
+  //after which any client that is not logged in or does not answer is
+  //disconnected. An idle timeout of 0 never disconnects anybody.
+  std::uint64_t heartbeat_interval = 30;
+  std::uint64_t idle_timeout = 90;
+};
+
+//Counts clients that could not keep up, over every session.
+struct slow_consumer_counters
+{
+  //Times a session's write queue reached its limits.
+  static std::atomic<unsigned long long>& overflows()
+  {
+    static std::atomic<unsigned long long> count(0);
+    return count;
+  }
+
+  static std::atomic<unsigned long long>& dropped_msgs()
+  {
+    static std::atomic<unsigned long long> count(0);
+    return count;
+  }
+
+  static std::atomic<unsigned long long>& disconnects()
+  {
+    static std::atomic<unsigned long long> count(0);
+    return count;
+  }
 };
 
 //----------------------------------------------------------------------
@@ -150,167 +416,470 @@ class chat_session
     public std::enable_shared_from_this<chat_session>
 {
 public:
-  chat_session(tcp::socket socket, chat_room room[10])
+  chat_session(tcp::socket socket, room_registry& rooms,
+      const session_config& config)
     : socket_(std::move(socket)),
-      room_(room)
+      strand_(socket_.get_executor()),
+      rooms_(rooms),
+      room_(rooms.find(0)),
+      config_(config),
+      framing_(chat_message::text_framing),
+      read_buffer_(std::max<std::size_t>(config.read_buffer_size, max_frame_length)),
+      first_message_(true),
+      queued_bytes_(0),
+      writing_msgs_(0),
+      missed_msgs_(0),
+      reported_msgs_(0),
+      reported_bytes_(0),
+      wheel_(asio::use_service<timing_wheel>(socket_.get_executor().context())),
+      replies_(asio::use_service<shard_replies>(socket_.get_executor().context())),
+      last_activity_(wheel_.now()),
+      heartbeats_(false),
+      logged_in_(false),
+      stopped_(false),
+      drain_scheduled_(false)
   {
     chat_room_number = 0;
   }
 
   void start()
   {
-    do_read_header(1);
+    if (config_.idle_timeout > 0)
+    {
+      std::weak_ptr<chat_session> weak = shared_from_this();
+      wheel_.add(wheel_.now() + next_check(),
+          [weak](std::uint64_t now) -> std::uint64_t
+          {
+            auto self = weak.lock();
+            return self ? self->check_idle(now) : 0;
+          });
+    }
+    do_read();
+  }
+
+  //Rooms on other strands deliver here. Messages wait in the inbox until one
+  //drain on this session's strand queues all of them, so a burst costs one
+  //hop onto the strand rather than one per message.
+  //The inbox mutex is taken once per message and recipient. It is only
+  //contended while this session's own drain swaps the inbox out, and it is
+  //what spares the room a strand hop per recipient.
+  void deliver(const chat_message_ptr& msg)
+  {
+    bool schedule;
+    {
+      std::lock_guard<std::mutex> lock(inbox_mutex_);
+      inbox_.push_back(msg);
+      schedule = !drain_scheduled_;
+      drain_scheduled_ = true;
+    }
+    if (schedule)
+      schedule_drain();
   }
 
-  void deliver(const chat_message& msg)
+  void deliver(std::vector<chat_message_ptr> msgs)
   {
-    bool write_in_progress = !write_msgs_.empty();
-    write_msgs_.push_back(msg);
-    if (!write_in_progress)
+    bool schedule;
     {
-      do_write();
+      std::lock_guard<std::mutex> lock(inbox_mutex_);
+      inbox_.insert(inbox_.end(), msgs.begin(), msgs.end());
+      schedule = !drain_scheduled_;
+      drain_scheduled_ = true;
     }
+    if (schedule)
+      schedule_drain();
   }
 
-private:
-  void do_read_header(int t)
+  std::size_t queued_msgs() const
   {
-    auto self(shared_from_this());
-    asio::async_read(socket_,
-        asio::buffer(read_msg_.data(), chat_message::header_length),
-        [this, self,t](std::error_code ec, std::size_t /*length*/)
-        {
-          if (!ec && read_msg_.decode_header())
-          {
-            do_read_body(t);
-          }
-          else
-          {
-            //sending a message to all the clients in the chatroom that the user has left.
-            on_quit(shared_from_this()->get_nickname());
-            room_[chat_room_number].leave(shared_from_this());
-          }
-        });
+    return reported_msgs_.load(std::memory_order_relaxed);
+  }
+
+  std::size_t queued_bytes() const
+  {
+    return reported_bytes_.load(std::memory_order_relaxed);
   }
 
-  void do_read_body(int t)
+private:
+  void do_read()
   {
+    //One read fills as much of the ring as the socket has ready.
     auto self(shared_from_this());
-    asio::async_read(socket_,
-        asio::buffer(read_msg_.body(), read_msg_.body_length()),
-        [this, self,t](std::error_code ec, std::size_t /*length*/)
+    socket_.async_read_some(read_buffer_.prepare(),
+        asio::bind_executor(strand_, make_custom_alloc_handler(read_memory_,
+        [this, self](std::error_code ec, std::size_t length)
         {
           if (!ec)
           {
-            std::string temp = read_msg_.body();
-            int len = read_msg_.body_length();
-            if(t == 1) //First time the user entered the port. The code checks if the nickname entered already exists.
-            {
-              client_name = temp.substr(0,len);
-              if(std::find(names.begin(),names.end(),client_name)!= names.end())
-                shared_from_this()->deliver(string_to_msg("~!Name"));
-              else
-              {
-                room_[chat_room_number].join(shared_from_this());
-                shared_from_this()->deliver(string_to_msg("~Name")); //sending a message back to the client.
-                shared_from_this()->set_nickname(client_name);
-                names.push_back(client_name);
-                //room_[chat_room_number].join_message(shared_from_this()->get_nickname());
-              }
-            }
-            else if(temp[0] == '~')
+            //Only the time is recorded; the wheel looks at it when it is due.
+            last_activity_.store(wheel_.now(), std::memory_order_relaxed);
+            server_metrics::bytes_in().add(length);
+            read_buffer_.commit(length);
+            //Handle every complete frame, only reading again for the rest.
+            bool valid = true;
+            while (valid && read_frame(valid))
+              handle_message();
+            if (valid)
             {
-              client_name = temp.substr(1,len-1);
-              if(std::find(names.begin(),names.end(),client_name)!= names.end())
-                shared_from_this()->deliver(string_to_msg("~!Name"));
-              else
-              {
-                room_[chat_room_number].join(shared_from_this());
-                shared_from_this()->deliver(string_to_msg("~Name"));
-                shared_from_this()->set_nickname(client_name);
-                names.push_back(client_name);
-                //room_[chat_room_number].join_message(shared_from_this()->get_nickname());
-              }
+              do_read();
+              return;
             }
-            else if(temp[0]=='\\') //Changing chatroom for a particular user.
-            {
-              chat_message msg;
-              std::cout<<"changing chatroom for "<<shared_from_this()->get_nickname()<<" to "<<temp.substr(1,1)<<"\n";
-              room_[chat_room_number].leave(shared_from_this());
-              chat_room_number = temp[1] -'0';
-              if(room_[chat_room_number].get_chatname() == "NULL") //The chatroom specified does not exist.
-              {
-                msg = string_to_msg("\\\\"); //Sending a message to the user that the chatroom doesnt exist.
-                room_[chat_room_number].join(shared_from_this());
-              }  
-              else //Changing chatroom if the chatroom specified exists.
-              {
-                std::string current = room_[chat_room_number].get_chatname();
-                msg = string_to_msg("\\"+current);
-                room_[chat_room_number].join(shared_from_this());
-                //room_[chat_room_number].join_message(shared_from_this()->get_nickname());
-              }  
-              shared_from_this()->deliver(msg);
-            }
-            else if(temp[0]=='!') //Changing name of the chatroom.
-            {
-              std::cout<<"Changed name of chatroom "<<chat_room_number <<" to "<<temp.substr(1,len-1)<<".\n";
-              room_[chat_room_number].set_chatname(temp.substr(1,len-1));
-              //room_[chat_room_number].join_message(shared_from_this()->get_nickname());
-            }
-            else if(temp[0] == '*') //Deleting the specified chatroom.
-            {
-              int num = temp[1] - '0';
-              if(room_[num].get_chatname() == "NULL") // The chatroom doesnt exist.
-                shared_from_this()->deliver(string_to_msg("*!"));
-              else if(room_[num].num_of_participants() != 0)
-                shared_from_this()->deliver(string_to_msg("*!"));
-              else 
-              {
-                std::cout<<"Deleted Chatroom number "<<num<<".\n";
-                room_[num].set_chatname("NULL");
-                room_[num].clear_messages();
-                shared_from_this()->deliver(string_to_msg("**"));
-              }
-            }
-            else if(temp[0] =='L' && temp[1] =='O' && temp[2] == 'R') //Returning a List of all chatrooms to the user.
-            {
-              std::string result = "[]LOR:Number    Name of Chatroom";
-              for(int i=0;i<10;i++)
-              {
-                if(room_[i].get_chatname() != "NULL")
-                  result = result + "\n\t" + "     "+ std::to_string(i) + "      " +room_[i].get_chatname();
-              }
-              result = result;
-              shared_from_this()->deliver(string_to_msg(result));
-            }
-            else //Just a normal message.
-            {
-              add_common_reply(temp.substr(2,len-2));
-              room_[chat_room_number].deliver(string_to_msg(temp.substr(0,len)));
-            }
-            do_read_header(0);
           }
-          else
+          stop();
+        })));
+  }
+
+  std::uint64_t next_check() const
+  {
+    return std::max<std::uint64_t>(1,
+        std::min(config_.heartbeat_interval, config_.idle_timeout));
+  }
+
+  //Runs on the timing wheel's strand, so it only reads atomics and hands
+  //anything it decides over to the session's strand.
+  //Returns the tick to be checked again at, or 0 when done.
+  std::uint64_t check_idle(std::uint64_t now)
+  {
+    if (stopped_)
+      return 0;
+    //Logged in clients with the text framing cannot answer pings.
+    bool heartbeats = heartbeats_.load(std::memory_order_relaxed);
+    if (!heartbeats && logged_in_.load(std::memory_order_relaxed))
+      return 0;
+
+    std::uint64_t last = last_activity_.load(std::memory_order_relaxed);
+    std::uint64_t idle = now - last;
+    auto self(shared_from_this());
+    if (idle >= config_.idle_timeout)
+    {
+      asio::post(strand_,
+          [this, self, idle]()
           {
-            //sending a message to all the clients in the chatroom that the user has left.
-            on_quit(shared_from_this()->get_nickname());
-            room_[chat_room_number].leave(shared_from_this());
-          }
-        });
+            std::string name = logged_in_ ? get_nickname() : "a client that never logged in";
+            std::cout<<"Disconnecting "<<name<<" after "<<idle<<" idle seconds.\n";
+            stop();
+          });
+      return 0;
+    }
+    if (heartbeats && idle >= config_.heartbeat_interval)
+    {
+      deliver(string_to_msg("", chat_message::ping_message));
+      return last + config_.idle_timeout;
+    }
+    return last + next_check();
+  }
+
+  //Leaves the room and gives up the nickname, once, however the session ends.
+  void stop()
+  {
+    if (stopped_)
+      return;
+    stopped_ = true;
+    server_metrics::connections_closed().add();
+    //sending a message to all the clients in the chatroom that the user has left.
+    on_quit(shared_from_this());
+    room_->leave(shared_from_this());
+    std::error_code ignored;
+    socket_.close(ignored);
+  }
+
+  void schedule_drain()
+  {
+    //Only one drain is ever scheduled. From another shard's thread the strand
+    //operation and the strand's invoker are both allocated, one block each.
+    auto self(shared_from_this());
+    asio::dispatch(strand_, make_custom_alloc_handler(deliver_memory_,
+        [this, self]()
+        {
+          drain_inbox();
+        }));
+  }
+
+  //Messages delivered while the drain runs are taken by the same drain, which
+  //also keeps a delivery made from inside it from starting another.
+  void drain_inbox()
+  {
+    for (;;)
+    {
+      {
+        std::lock_guard<std::mutex> lock(inbox_mutex_);
+        if (inbox_.empty())
+        {
+          drain_scheduled_ = false;
+          return;
+        }
+        draining_.swap(inbox_);
+      }
+      if (!stopped_)
+      {
+        bool write_in_progress = !write_msgs_.empty();
+        std::uint64_t now = server_metrics::now();
+        for (const auto& msg: draining_)
+        {
+          write_msgs_.push_back(msg);
+          queued_times_.push_back(now);
+          queued_bytes_ += msg->length();
+        }
+        server_metrics::queue_depth().record(write_msgs_.size());
+        limit_queue();
+        report_queue();
+        if (!write_in_progress && !write_msgs_.empty())
+        {
+          do_write();
+        }
+      }
+      draining_.clear(); //Both vectors keep their capacity.
+    }
+  }
+
+  //Applies the slow consumer policy once the write queue is over its limits.
+  //Messages already handed to the current write are never touched.
+  void limit_queue()
+  {
+    if (write_msgs_.size() <= config_.max_queue_msgs
+        && queued_bytes_ <= config_.max_queue_bytes)
+      return;
+    slow_consumer_counters::overflows().fetch_add(1, std::memory_order_relaxed);
+
+    if (config_.slow_policy == disconnect)
+    {
+      slow_consumer_counters::disconnects().fetch_add(1, std::memory_order_relaxed);
+      stop();
+      return;
+    }
+
+    auto first = write_msgs_.begin() + writing_msgs_;
+    auto last = first;
+    std::size_t dropped = 0;
+    if (config_.slow_policy == drop_oldest)
+    {
+      //Drop from the front until the rest fits.
+      while (last != write_msgs_.end()
+          && (write_msgs_.size() - (last - first) > config_.max_queue_msgs
+            || queued_bytes_ > config_.max_queue_bytes))
+      {
+        queued_bytes_ -= (*last)->length();
+        ++last;
+        ++dropped;
+      }
+    }
+    else
+    {
+      //Everything waiting, apart from the newest message, becomes one notice.
+      //A notice still waiting is folded into the new one.
+      bool notice_waiting = false;
+      for (last = first; last + 1 < write_msgs_.end(); ++last)
+      {
+        if (*last == missed_notice_)
+          notice_waiting = true;
+        else
+          ++dropped;
+        queued_bytes_ -= (*last)->length();
+      }
+      if (first == last)
+        return; //Only the newest message is waiting.
+      if (!notice_waiting)
+        missed_msgs_ = 0;
+      missed_msgs_ += dropped;
+    }
+    queued_times_.erase(queued_times_.begin() + (first - write_msgs_.begin()),
+        queued_times_.begin() + (last - write_msgs_.begin()));
+    last = write_msgs_.erase(first, last);
+    slow_consumer_counters::dropped_msgs().fetch_add(dropped, std::memory_order_relaxed);
+
+    if (config_.slow_policy == collapse)
+    {
+      missed_notice_ = string_to_msg("You missed "
+          + std::to_string(missed_msgs_) + " messages.");
+      queued_times_.insert(queued_times_.begin() + (last - write_msgs_.begin()),
+          server_metrics::now());
+      write_msgs_.insert(last, missed_notice_);
+      queued_bytes_ += missed_notice_->length();
+    }
+  }
+
+  //Publishes the size of the write queue for the admin socket.
+  void report_queue()
+  {
+    reported_msgs_.store(write_msgs_.size(), std::memory_order_relaxed);
+    reported_bytes_.store(queued_bytes_, std::memory_order_relaxed);
+  }
+
+  //Moves the next complete frame from the ring into read_msg_.
+  //Returns false when the frame is not complete yet or is invalid.
+  bool read_frame(bool& valid)
+  {
+    if (first_message_ && framing_ == chat_message::text_framing
+        && read_buffer_.size() >= chat_message::hello_length)
+    {
+      char hello[chat_message::hello_length];
+      read_buffer_.peek(hello, chat_message::hello_length);
+      if (chat_message::is_hello(hello))
+      {
+        //A new client asked for the binary framing before sending its nickname.
+        read_buffer_.consume(chat_message::hello_length);
+        framing_ = chat_message::binary_framing;
+        heartbeats_ = true;
+        deliver(string_to_msg("", chat_message::hello_message));
+      }
+    }
+
+    std::size_t header_length = chat_message::header_length;
+    if (framing_ == chat_message::binary_framing)
+      header_length = chat_message::binary_header_length;
+    if (read_buffer_.size() < header_length)
+      return false;
+
+    if (framing_ == chat_message::binary_framing)
+    {
+      read_buffer_.peek(read_msg_.binary_header(), header_length);
+      valid = read_msg_.decode_binary_header();
+    }
+    else
+    {
+      read_buffer_.peek(read_msg_.data(), header_length);
+      valid = read_msg_.decode_header();
+    }
+    if (!valid || read_buffer_.size() < header_length + read_msg_.body_length())
+      return false;
+
+    read_buffer_.consume(header_length);
+    read_buffer_.peek(read_msg_.body(), read_msg_.body_length());
+    read_buffer_.consume(read_msg_.body_length());
+    return true;
+  }
+
+  void handle_message()
+  {
+    server_metrics::messages_in().add();
+    if(read_msg_.type() == chat_message::ping_message)
+    {
+      deliver(string_to_msg("", chat_message::pong_message));
+      return;
+    }
+    if(read_msg_.type() != chat_message::text_message) //Pongs only show the client is alive.
+      return;
+
+    std::string temp(read_msg_.body(), read_msg_.body_length());
+    int len = read_msg_.body_length();
+    //Answers carry the id of the request they answer.
+    std::uint32_t request = read_msg_.request_id();
+    if(first_message_) //First time the user entered the port. The code checks if the nickname entered already exists.
+    {
+      first_message_ = false;
+      logged_in_ = true;
+      register_nickname(temp.substr(0,len), request);
+    }
+    else if(temp[0] == '~')
+    {
+      register_nickname(temp.substr(1,len-1), request);
+    }
+    else if(temp[0]=='\\') //Changing chatroom for a particular user.
+    {
+      room_registry::room_id id;
+      chat_room_ptr next;
+      if(room_registry::parse_id(temp.substr(1), id))
+        next = rooms_.get_or_create(id);
+      if(!next) //Not a room number, or no more rooms can be created.
+      {
+        deliver(string_to_msg("\\!", chat_message::text_message, request));
+        return;
+      }
+      std::cout<<"changing chatroom for "<<shared_from_this()->get_nickname()<<" to "<<id<<"\n";
+      room_->leave(shared_from_this());
+      room_ = next;
+      chat_room_number = id;
+      //The room tells the user whether the chatroom exists once they have joined it.
+      room_->change_to(shared_from_this(), request);
+    }
+    else if(temp[0]=='!') //Changing name of the chatroom.
+    {
+      std::cout<<"Changed name of chatroom "<<chat_room_number <<" to "<<temp.substr(1,len-1)<<".\n";
+      rooms_.set_chatname(chat_room_number, temp.substr(1,len-1));
+      //room_->join_message(shared_from_this()->get_nickname());
+    }
+    else if(temp[0] == '*') //Deleting the specified chatroom.
+    {
+      //The room checks on its own strand that it is named and empty.
+      room_registry::room_id num;
+      if(room_registry::parse_id(temp.substr(1), num))
+        rooms_.remove(num, shared_from_this(), request);
+      else
+        deliver(string_to_msg("*!", chat_message::text_message, request));
+    }
+    else if(temp.compare(0, 3, "LOR") == 0) //Returning a page of the list of chatrooms to the user.
+    {
+      //"LOR" starts at the first room, "LOR <number>" at that room number.
+      room_registry::room_id from = 0;
+      if(len > 4)
+        room_registry::parse_id(temp.substr(4), from);
+      deliver(string_to_msg(rooms_.list(from), chat_message::text_message, request));
+    }
+    else if(temp == "TOP") //The most frequent replies in this chatroom.
+    {
+      room_->top_replies(shared_from_this(), request);
+    }
+    else if(temp == "TOP *") //The most frequent replies in all chatrooms.
+    {
+      deliver(top_replies_msg(shard_replies::top(num_top_replies), request));
+    }
+    else if(len < 2) //Too short for a chat line ("<nickname> [HH:MM] : <text>").
+    {
+      return;
+    }
+    else //Just a normal message.
+    {
+      add_common_reply(temp.substr(2,len-2));
+      room_->deliver(string_to_msg(temp.substr(0,len)));
+    }
   }
 
   void do_write()
   {
+    //Flush as much of the queue as the limits allow with one gather write.
+    //The first message is always taken, whatever its size.
+    write_buffers_.clear();
+    std::size_t bytes = 0;
+    for (const auto& msg: write_msgs_)
+    {
+      if (!write_buffers_.empty()
+          && (write_buffers_.size() >= config_.max_write_buffers
+            || write_buffers_.size() + 2 > write_buffers_.capacity
+            || bytes + msg->length() > config_.max_write_bytes))
+        break;
+      if (framing_ == chat_message::binary_framing)
+      {
+        write_buffers_.push_back(asio::buffer(msg->binary_header(),
+              chat_message::binary_header_length));
+        write_buffers_.push_back(asio::buffer(msg->body(), msg->body_length()));
+      }
+      else
+        write_buffers_.push_back(asio::buffer(msg->data(), msg->length()));
+      bytes += msg->length();
+    }
+    writing_msgs_ = framing_ == chat_message::binary_framing
+      ? write_buffers_.size() / 2 : write_buffers_.size();
+
     auto self(shared_from_this());
-    asio::async_write(socket_,
-        asio::buffer(write_msgs_.front().data(),
-          write_msgs_.front().length()),
-        [this, self](std::error_code ec, std::size_t /*length*/)
+    asio::async_write(socket_, write_buffers_.buffers(),
+        asio::bind_executor(strand_, make_custom_alloc_handler(write_memory_,
+        [this, self](std::error_code ec, std::size_t length)
         {
           if (!ec)
           {
-            write_msgs_.pop_front();
+            std::uint64_t now = server_metrics::now();
+            for (std::size_t i = 0; i < writing_msgs_; ++i)
+            {
+              queued_bytes_ -= write_msgs_[i]->length();
+              server_metrics::delivery_latency().record(now - queued_times_[i]);
+            }
+            server_metrics::bytes_out().add(length);
+            server_metrics::messages_out().add(writing_msgs_);
+            write_msgs_.erase(write_msgs_.begin(),
+                write_msgs_.begin() + writing_msgs_);
+            queued_times_.erase(queued_times_.begin(),
+                queued_times_.begin() + writing_msgs_);
+            writing_msgs_ = 0;
+            report_queue();
             if (!write_msgs_.empty())
             {
               do_write();
@@ -318,130 +887,613 @@ private:
           }
           else
           {
-            //sending a message to all the clients in the chatroom that the user has left.
-            on_quit(shared_from_this()->get_nickname());
-            room_[chat_room_number].leave(shared_from_this());
+            stop();
           }
-        });
+        })));
+  }
+
+  void register_nickname(std::string client_name, std::uint32_t request)
+  {
+    if(!names.insert(client_name, shared_from_this()))
+    {
+      deliver(string_to_msg("~!Name", chat_message::text_message, request));
+      return;
+    }
+    //The nickname is set before joining so that the room only ever reads it.
+    set_nickname(client_name);
+    room_->join(shared_from_this());
+    deliver(string_to_msg("~Name", chat_message::text_message, request)); //sending a message back to the client.
+    //room_->join_message(get_nickname());
   }
 
   void add_common_reply(std::string message)
   {
     //Separate main part of message from beginning
     std::string delim = ": ";
-    int message_start = message.find(delim) + 2; //Add 2 because it finds location of : 
-    std::string reply = message.substr(message_start);
-    std::ifstream ifile;
-    std::ofstream ofile;
-
-    ifile.open("~.SuperChat.txt");
-    if(ifile.is_open() )   //Checking for existing file
-    {
-      ofile.open("~.SuperChat_new.txt", std::ofstream::app);
-      std::string line;
-      std::string delim1 = " ";
-      bool found = false;
-      while(std::getline(ifile, line) )   //Check if reply exists in file already
-      {
-        std::string line_mod = line.substr(0, line.rfind(delim1) );   //Gets rid of number at end of string
-        if(line_mod == reply)
-        {
-          found = true;
-          int reply_count = std::stoi(line.substr(line.rfind(delim1) + 1) ) + 1;    //Converts number at end of line into an int
-          reply = reply + " " + std::to_string(reply_count);
-          ofile << reply << std::endl;
-        }
-        else
-        {
-          ofile << line << std::endl;
-        }
-        
-      }
-      ifile.close();
-      ofile.close();
-      std::remove("~.SuperChat.txt");
-      std::rename("~.SuperChat_new.txt", "~.SuperChat.txt");
-
-      if(!found)    //Reply not found
-      {
-        reply = reply + " 1";   //Used to keep track of number of appearances
-        ofile.open("~.SuperChat.txt", std::ofstream::app);
-        ofile << reply << std::endl;
-        ofile.close();
-      }
-    }
-    else    //File doesn't exist yet
-    {
-      reply = reply + " 1";   //Used to keep track of number of appearances
-      ofile.open("~.SuperChat.txt", std::fstream::app);
-      ofile << reply << std::endl;
-      ofile.close();
-    }
+    std::string::size_type message_start = message.find(delim);
+    if(message_start == std::string::npos) //Not a chat line, so there is no reply to count.
+      return;
+    std::string reply = message.substr(message_start + 2); //Add 2 because it finds location of : 
+    common_replies.add(reply);
+    replies_.add(reply);
+    room_->add_reply(reply);
   }
-  
+
   tcp::socket socket_;
-  chat_room *room_;
+  strand_type strand_;
+  room_registry& rooms_;
+  chat_room_ptr room_;
+  const session_config& config_;
+  chat_message::framing framing_;
+  enum { max_frame_length = chat_message::binary_header_length
+    + chat_message::max_body_length };
+  ring_buffer read_buffer_;
+  //Handler storage for the one read, the one gather write and the one drain
+  //in flight.
+  handler_memory<512> read_memory_;
+  handler_memory<2048> write_memory_;
+  handler_memory<256, 2> deliver_memory_;
   chat_message read_msg_;
+  bool first_message_; //The first message carries the nickname.
   chat_message_queue write_msgs_;
-  int chat_room_number;
+  std::deque<std::uint64_t> queued_times_; //When each of write_msgs_ was queued.
+  std::size_t queued_bytes_; //Bytes of the messages in write_msgs_.
+  gather_buffers<session_config::write_buffer_capacity> write_buffers_;
+  std::size_t writing_msgs_; //Messages at the front of write_msgs_ being written.
+  chat_message_ptr missed_notice_; //The last "missed N messages" notice queued.
+  std::size_t missed_msgs_;
+  //The queue's size, read by the admin socket from other threads.
+  std::atomic<std::size_t> reported_msgs_;
+  std::atomic<std::size_t> reported_bytes_;
+  timing_wheel& wheel_;
+  shard_replies& replies_; //This shard's most frequent replies.
+  std::atomic<std::uint64_t> last_activity_; //Wheel tick of the last read.
+  std::atomic<bool> heartbeats_; //The client answers pings.
+  std::atomic<bool> logged_in_;
+  std::atomic<bool> stopped_;
+  std::mutex inbox_mutex_;
+  std::vector<chat_message_ptr> inbox_; //Delivered, not yet queued.
+  std::vector<chat_message_ptr> draining_; //Taken from the inbox by the drain.
+  bool drain_scheduled_; //Guarded by inbox_mutex_.
+  room_registry::room_id chat_room_number;
 };
 
 //----------------------------------------------------------------------
 
+//Lets several sockets listen on one port, the kernel spreading connections over them.
+typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+
+/*
+  By default one acceptor on the first shard hands every accepted socket to
+  the next shard in turn. With reuse_port every thread of the pool gets its
+  own SO_REUSEPORT acceptor on its shard, so accepts run in parallel and a
+  socket stays on the shard that accepted it.
+*/
 class chat_server
 {
 public:
-  chat_server(asio::io_context& io_context,
-      const tcp::endpoint& endpoint)
-    : acceptor_(io_context, endpoint)
+  chat_server(io_context_pool& pool, const tcp::endpoint& endpoint,
+      const session_config& config, const room_config& rooms, bool reuse_port)
+    : pool_(pool),
+      config_(config),
+      port_(endpoint.port()),
+      //Every port has its own rooms, so each logs to its own directory.
+      rooms_(pool, rooms, rooms.log_dir.empty() ? std::string()
+          : rooms.log_dir + "/" + std::to_string(endpoint.port()))
+  {
+    //Rooms are spread over the shards, each one owned by a single shard.
+    rooms_.get_or_create(0);
+    rooms_.set_chatname(0, "MAIN LOBBY");
+
+    if (!reuse_port)
+    {
+      acceptors_.emplace_back(pool.get_io_context(0), endpoint);
+      do_accept(acceptors_.back(), 0);
+      return;
+    }
+    std::size_t num_acceptors = pool.size() * pool.threads_per_io_context();
+    for (std::size_t i = 0; i < num_acceptors; ++i)
+    {
+      acceptors_.emplace_back(pool.get_io_context(i));
+      tcp::acceptor& acceptor = acceptors_.back();
+      acceptor.open(endpoint.protocol());
+      acceptor.set_option(tcp::acceptor::reuse_address(true));
+      acceptor.set_option(::reuse_port(true));
+      acceptor.bind(endpoint);
+      acceptor.listen();
+      do_accept(acceptor, &pool.get_io_context(i));
+    }
+  }
+
+  unsigned short port() const
   {
-    room_[0].set_chatname("MAIN LOBBY");
-    for(int i=1;i<11;i++)
-      room_[i].set_chatname("NULL");
+    return port_;
+  }
+
+  room_registry& rooms()
+  {
+    return rooms_;
+  }
+
+private:
+  //Accepts onto io_context, or onto the next shard in the pool when it is null.
+  void do_accept(tcp::acceptor& acceptor, asio::io_context* io_context)
+  {
+    acceptor.async_accept(io_context ? *io_context : pool_.get_io_context(),
+        [this, &acceptor, io_context](std::error_code ec, tcp::socket socket)
+        {
+          if (!ec)
+          {
+            server_metrics::connections_accepted().add();
+            std::make_shared<chat_session>(std::move(socket), rooms_, config_)->start();
+          }
+
+          do_accept(acceptor, io_context);
+        });
+  }
+
+  io_context_pool& pool_;
+  const session_config& config_;
+  unsigned short port_;
+  room_registry rooms_;
+  std::list<tcp::acceptor> acceptors_;
+};
+
+//----------------------------------------------------------------------
+
+//Quotes a string for JSON.
+std::string json_string(const std::string& str)
+{
+  std::string result = "\"";
+  for (char c: str)
+  {
+    if (c == '"' || c == '\\')
+      result += std::string("\\") + c;
+    else if (static_cast<unsigned char>(c) < 0x20)
+    {
+      char escaped[8];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      result += escaped;
+    }
+    else
+      result += c;
+  }
+  return result + "\"";
+}
+
+/*
+  Serves the server's metrics on a Unix domain socket. A client connects,
+  sends "json" or "text" (the default) on one line, and is sent a report of
+  the counters, the histograms, the busiest rooms and the longest write
+  queues before the connection is closed; for example
+
+    echo json | socat - UNIX-CONNECT:<path>
+
+  The report only reads atomics and takes the registries' locks briefly, so
+  it can be asked for as often as needed while the server is busy. Message
+  rates are sampled once a second.
+*/
+class admin_server
+{
+public:
+  typedef asio::local::stream_protocol protocol;
+
+  enum { num_listed = 10 }; //Rooms and sessions listed in a report.
+
+  admin_server(asio::io_context& io_context, const std::string& path,
+      std::list<chat_server>& servers)
+    : acceptor_(io_context),
+      timer_(io_context),
+      path_(path),
+      servers_(servers),
+      started_(std::chrono::steady_clock::now()),
+      sampled_(started_)
+  {
+    for (auto& rate: rates_)
+      rate.store(0, std::memory_order_relaxed);
+    for (auto& total: sampled_totals_)
+      total = 0;
+
+    ::unlink(path.c_str()); //Left behind by a server that did not stop cleanly.
+    acceptor_.open(protocol());
+    acceptor_.bind(protocol::endpoint(path));
+    acceptor_.listen();
     do_accept();
+    schedule_sample();
   }
 
+  ~admin_server()
+  {
+    ::unlink(path_.c_str());
+  }
+
+  std::string report(bool json);
+
 private:
+  //Totals whose rates are sampled.
+  enum { bytes_in, bytes_out, messages_in, messages_out, num_rates };
+
+  //Answers one request and closes the connection.
+  class session
+    : public std::enable_shared_from_this<session>
+  {
+  public:
+    session(protocol::socket socket, admin_server& server)
+      : socket_(std::move(socket)),
+        request_(max_request_length),
+        server_(server)
+    {
+    }
+
+    void start()
+    {
+      auto self(shared_from_this());
+      asio::async_read_until(socket_, request_, '\n',
+          [this, self](std::error_code ec, std::size_t /*length*/)
+          {
+            //A client may just as well close its end without asking anything.
+            if (ec && ec != asio::error::eof)
+              return;
+            std::string command(asio::buffers_begin(request_.data()),
+                asio::buffers_end(request_.data()));
+            response_ = server_.report(command.compare(0, 4, "json") == 0);
+            asio::async_write(socket_, asio::buffer(response_),
+                [this, self](std::error_code /*ec*/, std::size_t /*length*/)
+                {
+                });
+          });
+    }
+
+  private:
+    enum { max_request_length = 64 };
+
+    protocol::socket socket_;
+    asio::streambuf request_;
+    std::string response_;
+    admin_server& server_;
+  };
+
   void do_accept()
   {
     acceptor_.async_accept(
-        [this](std::error_code ec, tcp::socket socket)
+        [this](std::error_code ec, protocol::socket socket)
+        {
+          if (!ec)
+            std::make_shared<session>(std::move(socket), *this)->start();
+          do_accept();
+        });
+  }
+
+  void schedule_sample()
+  {
+    timer_.expires_after(std::chrono::seconds(1));
+    timer_.async_wait(
+        [this](std::error_code ec)
         {
           if (!ec)
           {
-            std::make_shared<chat_session>(std::move(socket), room_)->start();
+            sample();
+            schedule_sample();
           }
-
-          do_accept();
         });
   }
 
-  tcp::acceptor acceptor_;
-  chat_room room_[10];
+  //Turns the totals counted since the previous sample into rates.
+  void sample()
+  {
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - sampled_).count();
+    sampled_ = now;
+    if (seconds <= 0)
+      return;
+
+    std::uint64_t totals[num_rates] = { server_metrics::bytes_in().read(),
+      server_metrics::bytes_out().read(), server_metrics::messages_in().read(),
+      server_metrics::messages_out().read() };
+    for (int i = 0; i < num_rates; ++i)
+    {
+      rates_[i].store((totals[i] - sampled_totals_[i]) / seconds,
+          std::memory_order_relaxed);
+      sampled_totals_[i] = totals[i];
+    }
+    for (auto& server: servers_)
+      server.rooms().for_each(
+          [seconds](room_registry::room_id, const chat_room_ptr& room)
+          {
+            room->sample_rate(seconds);
+          });
+  }
+
+  protocol::acceptor acceptor_;
+  asio::steady_timer timer_;
+  std::string path_;
+  std::list<chat_server>& servers_;
+  std::chrono::steady_clock::time_point started_;
+  //Only touched by the sampling timer.
+  std::chrono::steady_clock::time_point sampled_;
+  std::uint64_t sampled_totals_[num_rates];
+  std::atomic<double> rates_[num_rates]; //Per second, as of the latest sample.
 };
 
+std::string admin_server::report(bool json)
+{
+  struct room_entry
+  {
+    double rate;
+    unsigned short port;
+    room_registry::room_id id;
+    chat_room_ptr room;
+  };
+  struct session_entry
+  {
+    std::size_t msgs;
+    std::size_t bytes;
+    std::string nickname;
+  };
+
+  //The busiest rooms, by their latest rate and then by participants.
+  std::vector<room_entry> rooms;
+  for (auto& server: servers_)
+  {
+    unsigned short port = server.port();
+    server.rooms().for_each(
+        [&rooms, port](room_registry::room_id id, const chat_room_ptr& room)
+        {
+          room_entry entry = { room->message_rate(), port, id, room };
+          rooms.push_back(entry);
+        });
+  }
+  auto busier = [](const room_entry& a, const room_entry& b)
+    {
+      return a.rate != b.rate ? a.rate > b.rate
+        : a.room->num_of_participants() > b.room->num_of_participants();
+    };
+  std::size_t num_rooms = rooms.size();
+  std::size_t listed = std::min<std::size_t>(num_listed, rooms.size());
+  std::partial_sort(rooms.begin(), rooms.begin() + listed, rooms.end(), busier);
+  rooms.resize(listed);
+
+  //The sessions with the longest write queues.
+  std::vector<session_entry> sessions;
+  names.for_each(
+      [&sessions](const std::string& nickname, const chat_participant_ptr& participant)
+      {
+        session_entry entry = { participant->queued_msgs(),
+          participant->queued_bytes(), nickname };
+        if (entry.msgs > 0)
+          sessions.push_back(entry);
+      });
+  auto longer = [](const session_entry& a, const session_entry& b)
+    {
+      return a.msgs != b.msgs ? a.msgs > b.msgs : a.bytes > b.bytes;
+    };
+  listed = std::min<std::size_t>(num_listed, sessions.size());
+  std::partial_sort(sessions.begin(), sessions.begin() + listed, sessions.end(), longer);
+  sessions.resize(listed);
+
+  std::uint64_t accepted = server_metrics::connections_accepted().read();
+  std::uint64_t closed = server_metrics::connections_closed().read();
+  std::uint64_t uptime = std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::steady_clock::now() - started_).count();
+  std::pair<const char*, std::uint64_t> counts[] = {
+    { "uptime_seconds", uptime },
+    { "connections", accepted - std::min(accepted, closed) },
+    { "connections_accepted", accepted },
+    { "rooms", num_rooms },
+    { "bytes_in", server_metrics::bytes_in().read() },
+    { "bytes_out", server_metrics::bytes_out().read() },
+    { "messages_in", server_metrics::messages_in().read() },
+    { "messages_out", server_metrics::messages_out().read() },
+    { "heap_allocations", server_metrics::heap_allocations().read() },
+    { "slow_consumer_overflows", slow_consumer_counters::overflows() },
+    { "slow_consumer_dropped_messages", slow_consumer_counters::dropped_msgs() },
+    { "slow_consumer_disconnects", slow_consumer_counters::disconnects() }
+  };
+  std::pair<const char*, double> rates[] = {
+    { "bytes_in_per_second", rates_[bytes_in].load(std::memory_order_relaxed) },
+    { "bytes_out_per_second", rates_[bytes_out].load(std::memory_order_relaxed) },
+    { "messages_in_per_second", rates_[messages_in].load(std::memory_order_relaxed) },
+    { "messages_out_per_second", rates_[messages_out].load(std::memory_order_relaxed) }
+  };
+  std::pair<const char*, histogram> histograms[] = {
+    { "fan_out", server_metrics::fan_out().read() },
+    { "queue_depth", server_metrics::queue_depth().read() },
+    { "delivery_latency_us", server_metrics::delivery_latency().read() }
+  };
+
+  std::ostringstream out;
+  out.precision(1);
+  out << std::fixed;
+  if (!json)
+  {
+    for (const auto& count: counts)
+      out << count.first << " " << count.second << "\n";
+    for (const auto& rate: rates)
+      out << rate.first << " " << rate.second << "\n";
+    for (const auto& h: histograms)
+      out << h.first << " count " << h.second.total
+        << " p50 " << h.second.percentile(0.5) << " p99 " << h.second.percentile(0.99)
+        << " p999 " << h.second.percentile(0.999) << " max " << h.second.max << "\n";
+    out << "\nbusiest rooms: port room participants messages messages_per_second name\n";
+    for (const auto& r: rooms)
+      out << r.port << " " << r.id << " " << r.room->num_of_participants() << " "
+        << r.room->num_of_messages() << " " << r.rate << " " << r.room->get_chatname() << "\n";
+    out << "\nlongest write queues: nickname messages bytes\n";
+    for (const auto& session: sessions)
+      out << session.nickname << " " << session.msgs << " " << session.bytes << "\n";
+    return out.str();
+  }
+
+  out << "{";
+  for (const auto& count: counts)
+    out << json_string(count.first) << ": " << count.second << ", ";
+  for (const auto& rate: rates)
+    out << json_string(rate.first) << ": " << rate.second << ", ";
+  for (const auto& h: histograms)
+    out << json_string(h.first) << ": {\"count\": " << h.second.total
+      << ", \"p50\": " << h.second.percentile(0.5)
+      << ", \"p99\": " << h.second.percentile(0.99)
+      << ", \"p999\": " << h.second.percentile(0.999)
+      << ", \"max\": " << h.second.max << "}, ";
+  out << "\"busiest_rooms\": [";
+  for (std::size_t i = 0; i < rooms.size(); ++i)
+    out << (i ? ", " : "") << "{\"port\": " << rooms[i].port
+      << ", \"room\": " << rooms[i].id
+      << ", \"name\": " << json_string(rooms[i].room->get_chatname())
+      << ", \"participants\": " << rooms[i].room->num_of_participants()
+      << ", \"messages\": " << rooms[i].room->num_of_messages()
+      << ", \"messages_per_second\": " << rooms[i].rate << "}";
+  out << "], \"longest_write_queues\": [";
+  for (std::size_t i = 0; i < sessions.size(); ++i)
+    out << (i ? ", " : "") << "{\"nickname\": " << json_string(sessions[i].nickname)
+      << ", \"messages\": " << sessions[i].msgs
+      << ", \"bytes\": " << sessions[i].bytes << "}";
+  out << "]}\n";
+  return out.str();
+}
+
 //----------------------------------------------------------------------
 
+//Every heap allocation of the server is counted, so the admin socket and the
+//exit report show whether the message path allocates.
+void* operator new(std::size_t size)
+{
+  server_metrics::heap_allocations().add();
+  if (void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+  return ::operator new(size);
+}
+
+//Not inlined, or an optimised build sees free() called on memory from new
+//and warns of a mismatch.
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void* p) noexcept
+{
+  std::free(p);
+}
+
 int main(int argc, char* argv[])
 {
   try
   {
-    if (argc < 2)
+    std::size_t num_shards = 1;
+    std::size_t num_threads = 1;
+    session_config config;
+    room_config rooms;
+    bool reuse_port = false;
+    std::string admin_path;
+    int first_port = 1;
+    while (argc > first_port + 1)
+    {
+      std::string option = argv[first_port];
+      if (option == "--reuseport") //The only option without a value.
+      {
+        reuse_port = true;
+        ++first_port;
+        continue;
+      }
+      std::size_t value = std::atoi(argv[first_port + 1]);
+      //0 shards or threads means one per core.
+      std::size_t per_core = value ? value : std::max(1u, std::thread::hardware_concurrency());
+      if (option == "--shards")
+        num_shards = per_core;
+      else if (option == "--threads") //Threads running each shard.
+        num_threads = per_core;
+      else if (option == "--write-buffers" && value > 0)
+        config.max_write_buffers = std::min<std::size_t>(value,
+            session_config::write_buffer_capacity);
+      else if (option == "--write-bytes" && value > 0)
+        config.max_write_bytes = value;
+      else if (option == "--read-buffer" && value > 0)
+        config.read_buffer_size = value;
+      else if (option == "--queue-msgs" && value > 0)
+        config.max_queue_msgs = value;
+      else if (option == "--queue-bytes" && value > 0)
+        config.max_queue_bytes = value;
+      else if (option == "--slow-policy" && argv[first_port + 1] == std::string("drop"))
+        config.slow_policy = drop_oldest;
+      else if (option == "--slow-policy" && argv[first_port + 1] == std::string("disconnect"))
+        config.slow_policy = disconnect;
+      else if (option == "--slow-policy" && argv[first_port + 1] == std::string("collapse"))
+        config.slow_policy = collapse;
+      else if (option == "--heartbeat" && value > 0)
+        config.heartbeat_interval = value;
+      else if (option == "--idle-timeout")
+        config.idle_timeout = value;
+      else if (option == "--max-rooms" && value > 0)
+        rooms.max_rooms = value;
+      else if (option == "--log-dir")
+        rooms.log_dir = argv[first_port + 1];
+      else if (option == "--admin")
+        admin_path = argv[first_port + 1];
+      else if (option == "--log-segment-size" && value > 0)
+        rooms.log_segment_size = value;
+      else if (option == "--log-segments" && value > 0)
+        rooms.log_segments = value;
+      else if (option == "--max-open-logs" && value > 0)
+        rooms.max_open_logs = value;
+      else
+        break;
+      first_port += 2;
+    }
+
+    if (argc <= first_port)
     {
-      std::cerr << "Usage: chat_server <port> [<port> ...]\n";
+      std::cerr << "Usage: chat_server [--shards <n>] [--threads <n>] [--reuseport]"
+        << " [--write-buffers <n>] [--write-bytes <n>] [--read-buffer <n>]"
+        << " [--queue-msgs <n>] [--queue-bytes <n>]"
+        << " [--slow-policy drop|disconnect|collapse]"
+        << " [--heartbeat <seconds>] [--idle-timeout <seconds>]"
+        << " [--max-rooms <n>] [--log-dir <dir>] [--log-segment-size <n>]"
+        << " [--log-segments <n>] [--max-open-logs <n>] [--admin <socket path>]"
+        << " <port> [<port> ...]\n";
       return 1;
     }
 
-    asio::io_context io_context;
+    common_replies.open("~.SuperChat.txt", "~.SuperChat.log");
+    io_context_pool pool(num_shards, num_threads);
 
     std::list<chat_server> servers;
-    for (int i = 1; i < argc; ++i)
+    for (int i = first_port; i < argc; ++i)
     {
       tcp::endpoint endpoint(tcp::v4(), std::atoi(argv[i]));
-      servers.emplace_back(io_context, endpoint);
+      servers.emplace_back(pool, endpoint, config, rooms, reuse_port);
     }
 
-    io_context.run();
+    std::unique_ptr<admin_server> admin;
+    if (!admin_path.empty())
+      admin.reset(new admin_server(pool.get_io_context(0), admin_path, servers));
+
+    //Stopping cleanly on a signal lets the server report its handler allocations.
+    asio::signal_set signals(pool.get_io_context(0), SIGINT, SIGTERM);
+    signals.async_wait(
+        [&pool](std::error_code /*ec*/, int /*signo*/)
+        {
+          pool.stop();
+        });
+
+    pool.run();
+    common_replies.close();
+
+    std::cout << "Handler allocations: "
+      << handler_allocation_counters::arena() << " from session arenas, "
+      << handler_allocation_counters::heap() << " from the heap.\n";
+    std::cout << "Heap allocations: " << server_metrics::heap_allocations().read()
+      << " in all, for " << server_metrics::messages_out().read()
+      << " messages written.\n";
+    std::cout << "Slow consumers: " << slow_consumer_counters::overflows()
+      << " full write queues, " << slow_consumer_counters::dropped_msgs()
+      << " messages dropped, " << slow_consumer_counters::disconnects()
+      << " clients disconnected.\n";
   }
   catch (std::exception& e)
   {
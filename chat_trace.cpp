@@ -0,0 +1,326 @@
+//
+// chat_trace.cpp
+// ~~~~~~~~~~~~~~
+//
+// Turns asio's handler tracking output into per-handler statistics and
+// collapsed stacks for flame graphs.
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+  A build with ASIO_ENABLE_HANDLER_TRACKING writes a line to stderr for
+  every handler asio creates, enters, leaves or destroys uninvoked:
+
+    @asio|<seconds>.<microseconds>|<creator>*<id>|<object>@<address>.<operation>
+    @asio|<seconds>.<microseconds>|><id>|<arguments>
+    @asio|<seconds>.<microseconds>|<<id>|
+    @asio|<seconds>.<microseconds>|~<id>|
+
+  A handler's kind is its object and operation without the address, such as
+  "socket.async_receive". Its time is measured from entering to leaving it,
+  less the time of handlers run inline from inside it (dispatch), and its
+  wait from its creation to entering it.
+
+  A handler's stack is the chain of kinds that caused it: the kind of the
+  handler that was running when it was created, and so on back to a handler
+  created outside any other. Loops, like a read handler starting the next
+  read, would make stacks grow forever, so a kind already on the stack cuts
+  the stack back to where it first appears.
+
+  Trace lines carry no thread, so inline handlers are recognised by
+  nesting. That only holds for a trace of one thread; with more, handlers of
+  other threads overlap and are reported as such.
+*/
+
+struct handler_kind_stats
+{
+  handler_kind_stats()
+    : total_us(0)
+  {
+  }
+
+  std::vector<std::uint64_t> run_us; //Self time of every invocation.
+  std::vector<std::uint64_t> wait_us;
+  std::uint64_t total_us;
+};
+
+class trace_analyzer
+{
+public:
+  trace_analyzer()
+    : overlaps_(0),
+      destroyed_(0),
+      first_us_(0),
+      last_us_(0)
+  {
+    stack_names_.push_back(std::string());
+    stack_frames_.push_back(std::vector<std::size_t>());
+  }
+
+  void add_line(const std::string& line)
+  {
+    //@asio|<timestamp>|<event>|<details>
+    if (line.compare(0, 6, "@asio|") != 0)
+      return;
+    std::string::size_type bar1 = line.find('|', 6);
+    std::string::size_type bar2 = bar1 == std::string::npos
+      ? bar1 : line.find('|', bar1 + 1);
+    if (bar2 == std::string::npos)
+      return;
+    std::uint64_t now = parse_timestamp(line.c_str() + 6);
+    if (first_us_ == 0)
+      first_us_ = now;
+    last_us_ = now;
+
+    std::string event = line.substr(bar1 + 1, bar2 - bar1 - 1);
+    std::string details = line.substr(bar2 + 1);
+    if (event.empty())
+      return;
+    std::string::size_type star = event.find('*');
+    if (star != std::string::npos)
+      created(std::strtoull(event.c_str(), 0, 10),
+          std::strtoull(event.c_str() + star + 1, 0, 10), details, now);
+    else if (event[0] == '>')
+      entered(std::strtoull(event.c_str() + 1, 0, 10), now);
+    else if (event[0] == '<')
+      left(std::strtoull(event.c_str() + 1, 0, 10), now);
+    else if (event[0] == '~')
+    {
+      handlers_.erase(std::strtoull(event.c_str() + 1, 0, 10));
+      ++destroyed_;
+    }
+  }
+
+  void print_stats(std::ostream& out) const
+  {
+    std::vector<std::pair<std::uint64_t, std::size_t>> order;
+    std::uint64_t total = 0;
+    for (std::size_t i = 0; i < kinds_.size(); ++i)
+    {
+      order.push_back(std::make_pair(kinds_[i].total_us, i));
+      total += kinds_[i].total_us;
+    }
+    std::sort(order.rbegin(), order.rend());
+
+    char line[512];
+    std::snprintf(line, sizeof(line), "Trace of %.3f s, %.3f s in handlers.\n",
+        (last_us_ - first_us_) / 1e6, total / 1e6);
+    out << line;
+    std::snprintf(line, sizeof(line), "%-40s %9s %10s %6s %8s %8s %8s %8s %8s %8s\n",
+        "handler", "count", "total ms", "share", "mean us", "p50 us", "p99 us",
+        "max us", "wait p50", "wait p99");
+    out << line;
+    for (const auto& entry: order)
+    {
+      const handler_kind_stats& k = kinds_[entry.second];
+      if (k.run_us.empty())
+        continue;
+      std::vector<std::uint64_t> run = k.run_us;
+      std::vector<std::uint64_t> wait = k.wait_us;
+      std::snprintf(line, sizeof(line),
+          "%-40s %9zu %10.1f %5.1f%% %8.1f %8llu %8llu %8llu %8llu %8llu\n",
+          kind_names_[entry.second].c_str(), run.size(), k.total_us / 1e3,
+          total ? 100.0 * k.total_us / total : 0.0,
+          double(k.total_us) / run.size(),
+          percentile(run, 0.5), percentile(run, 0.99),
+          percentile(run, 1.0), percentile(wait, 0.5), percentile(wait, 0.99));
+      out << line;
+    }
+    if (overlaps_ > 0)
+      out << overlaps_ << " handlers overlapped others instead of nesting in them;"
+        << " the trace has several threads, so self times include their handlers.\n";
+    if (destroyed_ > 0)
+      out << destroyed_ << " handlers were destroyed without being run.\n";
+  }
+
+  //One "kind;kind;kind microseconds" line per stack, for flamegraph.pl.
+  void print_collapsed(std::ostream& out) const
+  {
+    for (const auto& entry: stack_us_)
+      if (entry.second > 0)
+        out << stack_names_[entry.first] << " " << entry.second << "\n";
+  }
+
+private:
+  struct handler
+  {
+    std::size_t kind;
+    std::size_t stack;
+    std::uint64_t created_us;
+    std::uint64_t entered_us;
+    std::uint64_t nested_us; //Time spent in handlers run inline from this one.
+  };
+
+  static std::uint64_t parse_timestamp(const char* p)
+  {
+    char* end = 0;
+    std::uint64_t seconds = std::strtoull(p, &end, 10);
+    std::uint64_t microseconds = *end == '.' ? std::strtoull(end + 1, 0, 10) : 0;
+    return seconds * 1000000 + microseconds;
+  }
+
+  static unsigned long long percentile(std::vector<std::uint64_t>& values, double p)
+  {
+    if (values.empty())
+      return 0;
+    std::size_t n = std::min(values.size() - 1,
+        static_cast<std::size_t>(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + n, values.end());
+    return values[n];
+  }
+
+  std::size_t kind_of(const std::string& details)
+  {
+    //"<object>@<address>.<operation>" becomes "<object>.<operation>".
+    std::string name = details;
+    std::string::size_type at = details.find('@');
+    std::string::size_type dot = at == std::string::npos
+      ? at : details.find('.', at);
+    if (dot != std::string::npos)
+      name = details.substr(0, at) + details.substr(dot);
+    auto it = kind_ids_.find(name);
+    if (it != kind_ids_.end())
+      return it->second;
+    kind_ids_[name] = kinds_.size();
+    kind_names_.push_back(name);
+    kinds_.push_back(handler_kind_stats());
+    return kinds_.size() - 1;
+  }
+
+  //The stack of a handler of the given kind created by one with parent_stack.
+  std::size_t push_stack(std::size_t parent_stack, std::size_t kind)
+  {
+    std::vector<std::size_t> frames = stack_frames_[parent_stack];
+    auto loop = std::find(frames.begin(), frames.end(), kind);
+    if (loop != frames.end())
+      frames.erase(loop + 1, frames.end());
+    else
+      frames.push_back(kind);
+
+    std::string name;
+    for (std::size_t frame: frames)
+      name += (name.empty() ? "" : ";") + kind_names_[frame];
+    auto it = stack_ids_.find(name);
+    if (it != stack_ids_.end())
+      return it->second;
+    stack_ids_[name] = stack_names_.size();
+    stack_names_.push_back(name);
+    stack_frames_.push_back(frames);
+    return stack_names_.size() - 1;
+  }
+
+  void created(std::uint64_t creator, std::uint64_t id,
+      const std::string& details, std::uint64_t now)
+  {
+    std::size_t kind = kind_of(details);
+    std::size_t parent_stack = 0;
+    auto parent = handlers_.find(creator);
+    if (creator != 0 && parent != handlers_.end())
+      parent_stack = parent->second.stack;
+    handler h = { kind, push_stack(parent_stack, kind), now, 0, 0 };
+    handlers_[id] = h;
+  }
+
+  void entered(std::uint64_t id, std::uint64_t now)
+  {
+    auto it = handlers_.find(id);
+    if (it == handlers_.end())
+      return;
+    it->second.entered_us = now;
+    kinds_[it->second.kind].wait_us.push_back(now - it->second.created_us);
+    running_.push_back(id);
+  }
+
+  void left(std::uint64_t id, std::uint64_t now)
+  {
+    auto it = handlers_.find(id);
+    auto running = std::find(running_.begin(), running_.end(), id);
+    if (it == handlers_.end() || running == running_.end())
+      return;
+    bool innermost = running + 1 == running_.end();
+    if (!innermost)
+      ++overlaps_; //Another thread's handler is still running.
+    running_.erase(running);
+
+    handler& h = it->second;
+    std::uint64_t elapsed = now - h.entered_us;
+    std::uint64_t self = elapsed - std::min(elapsed, h.nested_us);
+    handler_kind_stats& k = kinds_[h.kind];
+    k.run_us.push_back(self);
+    k.total_us += self;
+    stack_us_[h.stack] += self;
+
+    //Whatever was entered before this handler and is still running called it.
+    if (innermost && !running_.empty())
+    {
+      auto outer = handlers_.find(running_.back());
+      if (outer != handlers_.end())
+        outer->second.nested_us += elapsed;
+    }
+    handlers_.erase(it);
+  }
+
+  std::unordered_map<std::uint64_t, handler> handlers_; //Created and not yet done.
+  std::vector<std::uint64_t> running_; //Entered and not yet left, innermost last.
+  std::map<std::string, std::size_t> kind_ids_;
+  std::vector<std::string> kind_names_;
+  std::vector<handler_kind_stats> kinds_;
+  std::map<std::string, std::size_t> stack_ids_;
+  std::vector<std::string> stack_names_; //Stack 0 is the empty stack.
+  std::vector<std::vector<std::size_t>> stack_frames_;
+  std::map<std::size_t, std::uint64_t> stack_us_; //Self time per stack.
+  std::size_t overlaps_;
+  std::size_t destroyed_;
+  std::uint64_t first_us_;
+  std::uint64_t last_us_;
+};
+
+int main(int argc, char* argv[])
+{
+  bool collapsed = false;
+  int first_arg = 1;
+  if (argc > first_arg && std::strcmp(argv[first_arg], "--collapsed") == 0)
+  {
+    collapsed = true;
+    ++first_arg;
+  }
+  if (argc > first_arg + 1)
+  {
+    std::cerr << "Usage: chat_trace [--collapsed] [<trace file>]\n";
+    return 1;
+  }
+
+  std::ifstream file;
+  if (argc == first_arg + 1)
+  {
+    file.open(argv[first_arg]);
+    if (!file)
+    {
+      std::cerr << "Could not open " << argv[first_arg] << ".\n";
+      return 1;
+    }
+  }
+  std::istream& in = argc == first_arg + 1 ? file : std::cin;
+
+  trace_analyzer analyzer;
+  std::string line;
+  while (std::getline(in, line))
+    analyzer.add_line(line);
+
+  if (collapsed)
+    analyzer.print_collapsed(std::cout);
+  else
+    analyzer.print_stats(std::cout);
+  return 0;
+}
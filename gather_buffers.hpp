@@ -0,0 +1,97 @@
+//
+// gather_buffers.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// A fixed-capacity list of buffers for one gather write.
+//
+
+#ifndef GATHER_BUFFERS_HPP
+#define GATHER_BUFFERS_HPP
+
+#include <array>
+#include <cstddef>
+#include "asio.hpp"
+
+/*
+  asio's write operation keeps its own copy of the buffer sequence it is
+  given, so writing a std::vector of buffers copies the vector to the heap
+  on every flush. The buffers live here instead, in storage owned by the
+  connection, and the write is given a view of them: two pointers, copied
+  for free. The storage must not change until the write completes.
+*/
+template <std::size_t Capacity>
+class gather_buffers
+{
+public:
+  typedef const asio::const_buffer* const_iterator;
+
+  //The buffer sequence handed to asio.
+  class view
+  {
+  public:
+    view(const_iterator begin, const_iterator end)
+      : begin_(begin),
+        end_(end)
+    {
+    }
+
+    const_iterator begin() const
+    {
+      return begin_;
+    }
+
+    const_iterator end() const
+    {
+      return end_;
+    }
+
+  private:
+    const_iterator begin_;
+    const_iterator end_;
+  };
+
+  enum { capacity = Capacity };
+
+  gather_buffers()
+    : size_(0)
+  {
+  }
+
+  gather_buffers(const gather_buffers&) = delete;
+  gather_buffers& operator=(const gather_buffers&) = delete;
+
+  std::size_t size() const
+  {
+    return size_;
+  }
+
+  bool empty() const
+  {
+    return size_ == 0;
+  }
+
+  //Returns false, adding nothing, when full.
+  bool push_back(const asio::const_buffer& buffer)
+  {
+    if (size_ == Capacity)
+      return false;
+    buffers_[size_++] = buffer;
+    return true;
+  }
+
+  void clear()
+  {
+    size_ = 0;
+  }
+
+  view buffers() const
+  {
+    return view(buffers_.data(), buffers_.data() + size_);
+  }
+
+private:
+  std::array<asio::const_buffer, Capacity> buffers_;
+  std::size_t size_;
+};
+
+#endif // GATHER_BUFFERS_HPP
@@ -0,0 +1,176 @@
+//
+// handler_memory.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Per-connection memory for asynchronous operation handlers.
+//
+
+#ifndef HANDLER_MEMORY_HPP
+#define HANDLER_MEMORY_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "asio.hpp"
+
+//Counts where handler memory came from, across every handler_memory.
+struct handler_allocation_counters
+{
+  static std::atomic<unsigned long long>& arena()
+  {
+    static std::atomic<unsigned long long> count(0);
+    return count;
+  }
+
+  static std::atomic<unsigned long long>& heap()
+  {
+    static std::atomic<unsigned long long> count(0);
+    return count;
+  }
+};
+
+/*
+  Storage for the handler of one outstanding asynchronous operation. A
+  connection only ever has one read and one write in flight, and asio frees
+  an operation's memory before invoking its handler, so a single block per
+  operation chain is reused for every message. An operation that hands its
+  handler's allocator on to a second one needs a block for each: a dispatch
+  onto a strand from outside it allocates the strand's operation and then
+  posts the strand's invoker with the same allocator. Anything that does
+  not fit (or arrives while every block is in use) falls back to the heap
+  and is counted, so a non-zero heap count in steady state points at a
+  handler that has outgrown its arena.
+*/
+template <std::size_t Size, std::size_t Blocks = 1>
+class handler_memory
+{
+public:
+  handler_memory()
+  {
+    for (auto& in_use: in_use_)
+      in_use = false;
+  }
+
+  handler_memory(const handler_memory&) = delete;
+  handler_memory& operator=(const handler_memory&) = delete;
+
+  void* allocate(std::size_t size)
+  {
+    if (size <= sizeof(storage_[0]))
+    {
+      for (std::size_t i = 0; i < Blocks; ++i)
+      {
+        if (!in_use_[i])
+        {
+          in_use_[i] = true;
+          handler_allocation_counters::arena().fetch_add(1, std::memory_order_relaxed);
+          return &storage_[i];
+        }
+      }
+    }
+
+    handler_allocation_counters::heap().fetch_add(1, std::memory_order_relaxed);
+    return ::operator new(size);
+  }
+
+  void deallocate(void* pointer)
+  {
+    for (std::size_t i = 0; i < Blocks; ++i)
+    {
+      if (pointer == &storage_[i])
+      {
+        in_use_[i] = false;
+        return;
+      }
+    }
+    ::operator delete(pointer);
+  }
+
+private:
+  typename std::aligned_storage<Size>::type storage_[Blocks];
+  bool in_use_[Blocks];
+};
+
+//The allocator asio finds through a custom_alloc_handler's get_allocator().
+template <typename T, typename Memory>
+class handler_allocator
+{
+public:
+  typedef T value_type;
+
+  explicit handler_allocator(Memory& memory)
+    : memory_(memory)
+  {
+  }
+
+  template <typename U>
+  handler_allocator(const handler_allocator<U, Memory>& other) ASIO_NOEXCEPT
+    : memory_(other.memory_)
+  {
+  }
+
+  bool operator==(const handler_allocator& other) const ASIO_NOEXCEPT
+  {
+    return &memory_ == &other.memory_;
+  }
+
+  bool operator!=(const handler_allocator& other) const ASIO_NOEXCEPT
+  {
+    return &memory_ != &other.memory_;
+  }
+
+  T* allocate(std::size_t n) const
+  {
+    return static_cast<T*>(memory_.allocate(sizeof(T) * n));
+  }
+
+  void deallocate(T* p, std::size_t /*n*/) const
+  {
+    return memory_.deallocate(p);
+  }
+
+private:
+  template <typename, typename> friend class handler_allocator;
+
+  Memory& memory_;
+};
+
+//Wraps a completion handler so its operation is allocated from memory.
+template <typename Handler, typename Memory>
+class custom_alloc_handler
+{
+public:
+  typedef handler_allocator<Handler, Memory> allocator_type;
+
+  custom_alloc_handler(Memory& memory, Handler handler)
+    : memory_(memory),
+      handler_(std::move(handler))
+  {
+  }
+
+  allocator_type get_allocator() const ASIO_NOEXCEPT
+  {
+    return allocator_type(memory_);
+  }
+
+  template <typename... Args>
+  void operator()(Args&&... args)
+  {
+    handler_(std::forward<Args>(args)...);
+  }
+
+private:
+  Memory& memory_;
+  Handler handler_;
+};
+
+template <typename Handler, typename Memory>
+inline custom_alloc_handler<Handler, Memory> make_custom_alloc_handler(
+    Memory& memory, Handler handler)
+{
+  return custom_alloc_handler<Handler, Memory>(memory, std::move(handler));
+}
+
+#endif // HANDLER_MEMORY_HPP
@@ -0,0 +1,76 @@
+//
+// history_ring.hpp
+// ~~~~~~~~~~~~~~~~
+//
+// A fixed-capacity ring that keeps the most recent items pushed into it.
+//
+
+#ifndef HISTORY_RING_HPP
+#define HISTORY_RING_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+/*
+  All slots are allocated up front. Pushing into a full ring overwrites the
+  oldest item in place, so a busy room's history never allocates or frees
+  anything but the items themselves.
+*/
+template <typename T>
+class history_ring
+{
+public:
+  explicit history_ring(std::size_t capacity)
+    : items_(capacity ? capacity : 1),
+      head_(0),
+      size_(0)
+  {
+  }
+
+  void push(const T& item)
+  {
+    std::size_t tail = head_ + size_;
+    if (tail >= items_.size())
+      tail -= items_.size();
+    items_[tail] = item;
+    if (size_ < items_.size())
+      ++size_;
+    else if (++head_ == items_.size())
+      head_ = 0;
+  }
+
+  //Appends the items, oldest first, to out.
+  void copy_to(std::vector<T>& out) const
+  {
+    out.reserve(out.size() + size_);
+    std::size_t first = std::min(size_, items_.size() - head_);
+    out.insert(out.end(), items_.begin() + head_, items_.begin() + head_ + first);
+    out.insert(out.end(), items_.begin(), items_.begin() + (size_ - first));
+  }
+
+  void clear()
+  {
+    for (auto& item: items_)
+      item = T();
+    head_ = 0;
+    size_ = 0;
+  }
+
+  std::size_t size() const
+  {
+    return size_;
+  }
+
+  std::size_t capacity() const
+  {
+    return items_.size();
+  }
+
+private:
+  std::vector<T> items_;
+  std::size_t head_;
+  std::size_t size_;
+};
+
+#endif // HISTORY_RING_HPP
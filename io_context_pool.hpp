@@ -0,0 +1,101 @@
+//
+// io_context_pool.hpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// A pool of io_context objects ("shards"). Each shard is normally run by
+// exactly one thread; running one shard from several threads requires the
+// objects living on it to serialise themselves with strands.
+//
+
+#ifndef IO_CONTEXT_POOL_HPP
+#define IO_CONTEXT_POOL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "asio.hpp"
+
+class io_context_pool
+{
+public:
+  typedef asio::executor_work_guard<asio::io_context::executor_type> work_guard;
+
+  explicit io_context_pool(std::size_t pool_size,
+      std::size_t threads_per_io_context = 1)
+    : threads_per_io_context_(threads_per_io_context),
+      next_io_context_(0)
+  {
+    if (pool_size == 0 || threads_per_io_context == 0)
+      throw std::runtime_error("io_context_pool size is 0");
+
+    //When a shard is only ever run from one thread, tell asio as much.
+    int concurrency_hint = static_cast<int>(threads_per_io_context);
+    for (std::size_t i = 0; i < pool_size; ++i)
+    {
+      io_contexts_.emplace_back(new asio::io_context(concurrency_hint));
+      work_.emplace_back(asio::make_work_guard(*io_contexts_.back()));
+    }
+  }
+
+  //Runs every io_context on its own threads and blocks until all have stopped.
+  void run()
+  {
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < io_contexts_.size(); ++i)
+    {
+      asio::io_context& io_context = *io_contexts_[i];
+      for (std::size_t j = (i == 0 ? 1 : 0); j < threads_per_io_context_; ++j)
+        threads.emplace_back([&io_context](){ io_context.run(); });
+    }
+
+    //The calling thread runs the first shard.
+    io_contexts_[0]->run();
+
+    for (auto& t: threads)
+      t.join();
+  }
+
+  void stop()
+  {
+    for (auto& io_context: io_contexts_)
+      io_context->stop();
+  }
+
+  std::size_t size() const
+  {
+    return io_contexts_.size();
+  }
+
+  std::size_t threads_per_io_context() const
+  {
+    return threads_per_io_context_;
+  }
+
+  asio::io_context& get_io_context(std::size_t index)
+  {
+    return *io_contexts_[index % io_contexts_.size()];
+  }
+
+  //Round-robin over the shards, used to spread new connections.
+  //Safe to call from any thread.
+  asio::io_context& get_io_context()
+  {
+    std::size_t next = next_io_context_.fetch_add(1, std::memory_order_relaxed);
+    return *io_contexts_[next % io_contexts_.size()];
+  }
+
+private:
+  io_context_pool(const io_context_pool&) = delete;
+  io_context_pool& operator=(const io_context_pool&) = delete;
+
+  std::vector<std::unique_ptr<asio::io_context>> io_contexts_;
+  std::list<work_guard> work_;
+  std::size_t threads_per_io_context_;
+  std::atomic<std::size_t> next_io_context_;
+};
+
+#endif // IO_CONTEXT_POOL_HPP
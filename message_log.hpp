@@ -0,0 +1,543 @@
+//
+// message_log.hpp
+// ~~~~~~~~~~~~~~~
+//
+// A persistent, segmented, append-only log of the messages sent to a room.
+//
+
+#ifndef MESSAGE_LOG_HPP
+#define MESSAGE_LOG_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "asio.hpp"
+#include "chat_message.hpp"
+
+/*
+  A log is a directory of fixed-size segment files. Each segment is named
+  after the sequence number of its first message and holds records of
+
+    [storage length, little-endian u32][binary header][text header][body]
+
+  back to back, where the storage is exactly a chat_message's own buffer
+  layout. Segments are created at full size and mapped, so an append is a
+  memcpy into the page cache: the kernel writes pages back in batches and
+  nothing is fsynced per message. Their blocks are allocated when they are
+  created, so a full disk makes creating a segment fail instead of raising
+  SIGBUS on a write through the mapping. A zero length marks the end of a
+  segment.
+
+  Every index_interval bytes the tail segment also appends a (sequence,
+  offset) pair to its ".index" file, through the one file descriptor an
+  open log holds. Opening a log only scans forward from the last indexed
+  record, and reading from a sequence number scans at most one interval.
+  Messages read back borrow their storage from the mapping, which stays
+  alive for as long as any of them does.
+
+  Creating a segment allocates its blocks and maps it, which can take a
+  while on a busy disk. Given a log_worker, a log has the worker create
+  the next segment as "next.log" while it fills the current one, so
+  moving on to it is only a rename; without one, or when the worker falls
+  behind, the segment is created on the spot.
+*/
+//A thread of its own for the file system work of message logs.
+class log_worker
+{
+public:
+  log_worker()
+    : work_(asio::make_work_guard(io_context_)),
+      thread_([this](){ io_context_.run(); })
+  {
+  }
+
+  log_worker(const log_worker&) = delete;
+  log_worker& operator=(const log_worker&) = delete;
+
+  //Finishes the work already posted.
+  ~log_worker()
+  {
+    work_.reset();
+    thread_.join();
+  }
+
+  template <typename Function>
+  void post(Function f)
+  {
+    asio::post(io_context_, std::move(f));
+  }
+
+private:
+  asio::io_context io_context_;
+  asio::executor_work_guard<asio::io_context::executor_type> work_;
+  std::thread thread_;
+};
+
+class message_log
+{
+public:
+  typedef std::shared_ptr<const chat_message> message_ptr;
+
+  enum { index_interval = 4096 };
+
+  message_log(const std::string& path, std::size_t segment_size,
+      std::size_t max_segments, log_worker* worker = 0)
+    : path_(path),
+      segment_size_(std::max<std::size_t>(segment_size, record_header_length
+          + storage_header_length + chat_message::max_body_length + 1)),
+      max_segments_(std::max<std::size_t>(max_segments, 1)),
+      worker_(worker)
+  {
+  }
+
+  message_log(const message_log&) = delete;
+  message_log& operator=(const message_log&) = delete;
+
+  //Waits for a segment the worker is creating and deletes it, so nothing
+  //is left behind in the directory once the log is closed.
+  ~message_log()
+  {
+    if (!spare_)
+      return;
+    std::lock_guard<std::mutex> lock(spare_->mutex);
+    spare_->cancelled = true;
+    if (spare_->next)
+      std::remove(spare_->path.c_str());
+  }
+
+  //Finds the existing segments and maps the newest one for appending.
+  bool open()
+  {
+    if (!make_directory(path_))
+      return false;
+
+    DIR* dir = ::opendir(path_.c_str());
+    if (!dir)
+      return false;
+    while (dirent* entry = ::readdir(dir))
+    {
+      std::string name = entry->d_name;
+      if (name.size() == 24 && name.compare(20, 4, ".log") == 0
+          && name.find_first_not_of("0123456789") == 20)
+        segments_[std::strtoull(name.c_str(), 0, 10)];
+    }
+    ::closedir(dir);
+
+    if (segments_.empty())
+      return start_segment(0);
+    tail_ = load(segments_.rbegin()->first);
+    if (!tail_)
+      return false;
+    tail_->open_index(segment_path(tail_->base, ".index"));
+    segments_[tail_->base] = tail_;
+    prepare_next();
+    return true;
+  }
+
+  //Sequence number of the oldest message still kept.
+  std::uint64_t begin() const
+  {
+    return segments_.empty() ? 0 : segments_.begin()->first;
+  }
+
+  //Sequence number the next message will get.
+  std::uint64_t end() const
+  {
+    return tail_ ? tail_->base + tail_->count : 0;
+  }
+
+  void append(const chat_message& msg)
+  {
+    if (!tail_)
+      return;
+    std::size_t storage = storage_header_length + msg.body_length();
+    if (tail_->end + record_header_length + storage + record_header_length
+        > tail_->size)
+    {
+      //The zero length left after the last record ends the full segment.
+      ::msync(tail_->data, tail_->size, MS_ASYNC);
+      if (!start_segment(end()))
+        return;
+    }
+
+    //The length goes in last, so a half written record still ends the segment.
+    char* record = tail_->data + tail_->end;
+    std::memcpy(record + record_header_length, msg.binary_header(), storage);
+    encode_length(record, static_cast<std::uint32_t>(storage));
+    if (tail_->end >= tail_->next_index)
+    {
+      tail_->add_index(tail_->base + tail_->count, tail_->end, true);
+      tail_->next_index = tail_->end + index_interval;
+    }
+    tail_->end += record_header_length + storage;
+    ++tail_->count;
+  }
+
+  //Appends up to max messages starting at sequence number from to out.
+  void read(std::uint64_t from, std::size_t max, std::vector<message_ptr>& out)
+  {
+    from = std::max(from, begin());
+    auto it = segments_.upper_bound(from);
+    if (it == segments_.begin())
+      return;
+    --it;
+    for (std::size_t n = 0; n < max && it != segments_.end(); ++it)
+    {
+      std::shared_ptr<segment> s = it->second ? it->second : load(it->first);
+      if (!s)
+        return;
+
+      //Start from the last indexed record at or before from.
+      std::size_t offset = 0;
+      std::uint64_t seq = s->base;
+      auto entry = std::upper_bound(s->index.begin(), s->index.end(), from,
+          [](std::uint64_t value, const index_entry& e){ return value < e.seq; });
+      if (entry != s->index.begin())
+      {
+        --entry;
+        seq = entry->seq;
+        offset = entry->offset;
+      }
+
+      for (; n < max && offset < s->end; ++seq)
+      {
+        std::size_t storage = decode_length(s->data + offset);
+        if (seq >= from)
+        {
+          out.push_back(borrow(s, s->data + offset + record_header_length,
+                storage - storage_header_length));
+          ++n;
+        }
+        offset += record_header_length + storage;
+      }
+      from = seq;
+    }
+  }
+
+  //Whether a log was ever opened at path.
+  static bool exists(const std::string& path)
+  {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+  }
+
+  //Creates path and every missing directory above it.
+  static bool make_directory(const std::string& path)
+  {
+    for (std::size_t i = 1; i <= path.size(); ++i)
+    {
+      if (i < path.size() && path[i] != '/')
+        continue;
+      if (::mkdir(path.substr(0, i).c_str(), 0755) != 0 && errno != EEXIST)
+        return false;
+    }
+    return true;
+  }
+
+  //Deletes the log at path, which must not be open.
+  static void remove(const std::string& path)
+  {
+    DIR* dir = ::opendir(path.c_str());
+    if (!dir)
+      return;
+    std::vector<std::string> names;
+    while (dirent* entry = ::readdir(dir))
+      if (entry->d_name[0] != '.')
+        names.push_back(entry->d_name);
+    ::closedir(dir);
+    for (const auto& name: names)
+      std::remove((path + "/" + name).c_str());
+    ::rmdir(path.c_str());
+  }
+
+private:
+  enum { record_header_length = 4 };
+  enum { storage_header_length = chat_message::binary_header_length
+    + chat_message::header_length };
+
+  struct index_entry
+  {
+    std::uint64_t seq;
+    std::uint64_t offset;
+  };
+
+  //A mapped segment file; unmapped once neither the log nor a message uses it.
+  struct segment
+  {
+    segment()
+      : data(0), size(0), end(0), next_index(0), base(0), count(0), index_fd(-1)
+    {
+    }
+
+    ~segment()
+    {
+      if (data)
+        ::munmap(data, size);
+      close_index();
+    }
+
+    void open_index(const std::string& path)
+    {
+      index_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+
+    void close_index()
+    {
+      if (index_fd >= 0)
+        ::close(index_fd);
+      index_fd = -1;
+    }
+
+    void add_index(std::uint64_t seq, std::size_t offset, bool persist)
+    {
+      index_entry entry = { seq, offset };
+      index.push_back(entry);
+      //The index only speeds up seeks; it can be rebuilt by scanning, so a
+      //failed write is ignored.
+      if (persist && index_fd >= 0 && ::write(index_fd, &entry, sizeof(entry)) < 0)
+      {
+      }
+    }
+
+    char* data;
+    std::size_t size;
+    std::size_t end; //Offset of the first free byte.
+    std::size_t next_index; //Offset at which the next index entry is due.
+    std::uint64_t base;
+    std::uint64_t count;
+    int index_fd; //Open on the tail, which adds to its index.
+    std::vector<index_entry> index;
+  };
+
+  //The segment the worker creates ahead of time, shared with its job.
+  struct spare_segment
+  {
+    spare_segment()
+      : cancelled(false)
+    {
+    }
+
+    std::mutex mutex; //Held by the job while it creates the segment.
+    std::string path;
+    std::shared_ptr<segment> next; //Null until created.
+    bool cancelled; //The log was closed.
+  };
+
+  //A message borrowing its storage, which keeps the segment mapped.
+  struct mapped_message
+  {
+    mapped_message(const std::shared_ptr<segment>& s, chat_message&& m)
+      : owner(s),
+        msg(std::move(m))
+    {
+    }
+
+    std::shared_ptr<segment> owner;
+    chat_message msg;
+  };
+
+  static message_ptr borrow(const std::shared_ptr<segment>& s, char* storage,
+      std::size_t length)
+  {
+    auto m = std::make_shared<mapped_message>(s, chat_message::borrowed(storage,
+          length, static_cast<chat_message::message_type>(storage[4])));
+    return message_ptr(m, &m->msg);
+  }
+
+  static void encode_length(char* p, std::uint32_t n)
+  {
+    for (int i = 0; i < record_header_length; ++i)
+      p[i] = static_cast<char>((n >> (8 * i)) & 0xff);
+  }
+
+  static std::uint32_t decode_length(const char* p)
+  {
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return u[0] | u[1] << 8 | u[2] << 16 | static_cast<std::uint32_t>(u[3]) << 24;
+  }
+
+  std::string segment_path(std::uint64_t base, const char* extension) const
+  {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%020llu",
+        static_cast<unsigned long long>(base));
+    return path_ + "/" + name + extension;
+  }
+
+  //Maps a segment file, creating it when it does not exist.
+  std::shared_ptr<segment> map(std::uint64_t base)
+  {
+    std::shared_ptr<segment> s = map_file(segment_path(base, ".log"), segment_size_);
+    if (s)
+      s->base = base;
+    return s;
+  }
+
+  //Maps the file at path, creating it with size bytes when it does not exist.
+  static std::shared_ptr<segment> map_file(const std::string& path, std::size_t size)
+  {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+      return std::shared_ptr<segment>();
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0)
+      size = st.st_size;
+    else if (::posix_fallocate(fd, 0, size) != 0)
+    {
+      //Without the blocks reserved, a full disk would only show as a SIGBUS
+      //when a new page of the mapping is first written.
+      ::close(fd);
+      std::remove(path.c_str());
+      return std::shared_ptr<segment>();
+    }
+    void* data = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+      return std::shared_ptr<segment>();
+
+    auto s = std::make_shared<segment>();
+    s->data = static_cast<char*>(data);
+    s->size = size;
+    return s;
+  }
+
+  //Maps an existing segment and finds its end, starting at the last index entry.
+  //Only the tail stays in segments_; older ones are mapped again for each read.
+  std::shared_ptr<segment> load(std::uint64_t base)
+  {
+    std::shared_ptr<segment> s = map(base);
+    if (!s)
+      return s;
+
+    std::FILE* index = std::fopen(segment_path(base, ".index").c_str(), "rb");
+    index_entry entry;
+    while (index && std::fread(&entry, sizeof(entry), 1, index) == 1)
+      if (entry.offset < s->size && entry.seq >= base)
+        s->add_index(entry.seq, entry.offset, false);
+    if (index)
+      std::fclose(index);
+
+    std::uint64_t seq = base;
+    std::size_t offset = 0;
+    if (!s->index.empty())
+    {
+      seq = s->index.back().seq;
+      offset = s->index.back().offset;
+    }
+    while (offset + record_header_length <= s->size)
+    {
+      std::size_t storage = decode_length(s->data + offset);
+      if (storage < storage_header_length
+          || storage > storage_header_length + chat_message::max_body_length
+          || offset + record_header_length + storage > s->size)
+        break;
+      offset += record_header_length + storage;
+      ++seq;
+    }
+    s->end = offset;
+    s->count = seq - base;
+    s->next_index = s->index.empty() ? 0 : s->index.back().offset + index_interval;
+    while (s->next_index <= s->end && !s->index.empty())
+      s->next_index += index_interval;
+    return s;
+  }
+
+  bool start_segment(std::uint64_t base)
+  {
+    //Older segments are unmapped unless a message still uses them, and
+    //dropped past the limit.
+    if (tail_)
+    {
+      tail_->close_index();
+      segments_[tail_->base].reset();
+    }
+    while (segments_.size() >= max_segments_)
+    {
+      std::remove(segment_path(segments_.begin()->first, ".log").c_str());
+      std::remove(segment_path(segments_.begin()->first, ".index").c_str());
+      segments_.erase(segments_.begin());
+    }
+
+    std::remove(segment_path(base, ".index").c_str());
+    tail_ = take_next(base);
+    if (!tail_)
+    {
+      std::remove(segment_path(base, ".log").c_str());
+      tail_ = map(base);
+    }
+    if (!tail_)
+      return false;
+    tail_->open_index(segment_path(base, ".index"));
+    segments_[base] = tail_;
+    prepare_next();
+    return true;
+  }
+
+  //Has the worker create the segment after the tail.
+  void prepare_next()
+  {
+    if (!worker_)
+      return;
+    spare_ = std::make_shared<spare_segment>();
+    spare_->path = path_ + "/next.log";
+    std::shared_ptr<spare_segment> spare = spare_;
+    std::size_t size = segment_size_;
+    worker_->post(
+        [spare, size]()
+        {
+          std::lock_guard<std::mutex> lock(spare->mutex);
+          if (spare->cancelled)
+            return;
+          std::remove(spare->path.c_str());
+          spare->next = map_file(spare->path, size);
+        });
+  }
+
+  //The segment the worker created, renamed for base, or null if it has
+  //not been created.
+  std::shared_ptr<segment> take_next(std::uint64_t base)
+  {
+    if (!spare_)
+      return std::shared_ptr<segment>();
+    std::shared_ptr<segment> next;
+    {
+      //Waits while the worker is creating it; one the worker has not got to
+      //yet is cancelled instead.
+      std::lock_guard<std::mutex> lock(spare_->mutex);
+      spare_->cancelled = true;
+      next.swap(spare_->next);
+    }
+    if (!next)
+      return next;
+    if (std::rename(spare_->path.c_str(), segment_path(base, ".log").c_str()) != 0)
+      return std::shared_ptr<segment>();
+    next->base = base;
+    return next;
+  }
+
+  std::string path_;
+  std::size_t segment_size_;
+  std::size_t max_segments_;
+  log_worker* worker_; //Null when segments are created on the spot.
+  std::shared_ptr<spare_segment> spare_;
+  //Every kept segment by base sequence number, mapped while in use.
+  std::map<std::uint64_t, std::shared_ptr<segment>> segments_;
+  std::shared_ptr<segment> tail_;
+};
+
+#endif // MESSAGE_LOG_HPP
@@ -0,0 +1,119 @@
+//
+// nickname_registry.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Hashed, thread-safe map from nickname to the participant using it.
+//
+
+#ifndef NICKNAME_REGISTRY_HPP
+#define NICKNAME_REGISTRY_HPP
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+  The registry is split into stripes by nickname hash, each with its own
+  mutex, so logins and disconnects on different threads rarely contend.
+  Every operation is an average O(1) hash lookup in a single stripe. The
+  registry only holds weak references; sessions remove their own nickname
+  when they quit.
+*/
+template <typename Participant>
+class nickname_registry
+{
+public:
+  typedef std::shared_ptr<Participant> participant_ptr;
+
+  enum { num_stripes = 16 };
+
+  //Claims the nickname for participant. Returns false if it is taken.
+  bool insert(const std::string& nickname, const participant_ptr& participant)
+  {
+    stripe& s = stripe_for(nickname);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto result = s.names.emplace(nickname, participant);
+    if (result.second)
+      return true;
+    //A participant that went away without quitting no longer holds the name.
+    if (!result.first->second.expired())
+      return false;
+    result.first->second = participant;
+    return true;
+  }
+
+  bool contains(const std::string& nickname)
+  {
+    stripe& s = stripe_for(nickname);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return s.names.find(nickname) != s.names.end();
+  }
+
+  //The participant using the nickname, or null.
+  participant_ptr find(const std::string& nickname)
+  {
+    stripe& s = stripe_for(nickname);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.names.find(nickname);
+    return it == s.names.end() ? participant_ptr() : it->second.lock();
+  }
+
+  //Releases the nickname, but only if participant is the one holding it.
+  bool erase(const std::string& nickname, const Participant* participant)
+  {
+    stripe& s = stripe_for(nickname);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.names.find(nickname);
+    if (it == s.names.end())
+      return false;
+    participant_ptr owner = it->second.lock();
+    if (owner && owner.get() != participant)
+      return false;
+    s.names.erase(it);
+    return true;
+  }
+
+  //Calls f(nickname, participant) for every participant still alive,
+  //holding one stripe's lock at a time.
+  template <typename Function>
+  void for_each(Function f)
+  {
+    for (auto& s: stripes_)
+    {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      for (const auto& entry: s.names)
+        if (participant_ptr participant = entry.second.lock())
+          f(entry.first, participant);
+    }
+  }
+
+  std::size_t size()
+  {
+    std::size_t n = 0;
+    for (auto& s: stripes_)
+    {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      n += s.names.size();
+    }
+    return n;
+  }
+
+private:
+  struct stripe
+  {
+    std::mutex mutex;
+    std::unordered_map<std::string, std::weak_ptr<Participant>> names;
+  };
+
+  stripe& stripe_for(const std::string& nickname)
+  {
+    return stripes_[std::hash<std::string>()(nickname) % num_stripes];
+  }
+
+  stripe stripes_[num_stripes];
+};
+
+#endif // NICKNAME_REGISTRY_HPP
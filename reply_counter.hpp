@@ -0,0 +1,225 @@
+//
+// reply_counter.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+// In-memory reply frequencies, persisted through an append-only delta log.
+//
+
+#ifndef REPLY_COUNTER_HPP
+#define REPLY_COUNTER_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "server_metrics.hpp"
+
+/*
+  Counting a reply only queues it for the writer thread, so the thread
+  handling the message never waits on the disk or on other threads. Replies
+  are queued in stripes, like the server's metrics: a thread always uses
+  the same stripe, and up to metric_stripes::count threads each have one to
+  themselves, so a stripe's mutex is only ever contended by the writer.
+  Every flush interval the writer empties the stripes, adds the replies to
+  the table and appends them to the delta log, one per line. Once the log
+  holds more lines than the table has entries it writes a fresh snapshot
+  ("reply count" per line, the format the server always used) and starts
+  the log over. Loading reads the snapshot and replays the log on top of it.
+
+  The snapshot replaces the old one by rename before the log is truncated;
+  a crash between the two would count the logged replies twice.
+*/
+class reply_counter
+{
+public:
+  enum { min_compact_lines = 4096 };
+  enum { flush_interval_ms = 50 };
+
+  reply_counter()
+    : stopping_(false),
+      log_lines_(0)
+  {
+  }
+
+  ~reply_counter()
+  {
+    close();
+  }
+
+  //Loads the counts and starts the writer thread.
+  void open(const std::string& snapshot_path, const std::string& log_path)
+  {
+    snapshot_path_ = snapshot_path;
+    log_path_ = log_path;
+    load();
+
+    //Whatever was replayed from the log is folded into a new snapshot.
+    if (log_lines_ > 0)
+      write_snapshot(counts_);
+    log_.open(log_path_, std::ofstream::trunc);
+    log_lines_ = 0;
+
+    stopping_ = false;
+    writer_ = std::thread([this](){ run(); });
+  }
+
+  //Writes out every reply added so far and stops the writer thread.
+  void close()
+  {
+    if (!writer_.joinable())
+      return;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+    log_.close();
+  }
+
+  void add(const std::string& reply)
+  {
+    stripe& pending = pending_[metric_stripes::current()];
+    std::lock_guard<std::mutex> lock(pending.mutex);
+    pending.replies.push_back(reply);
+  }
+
+  //The counts lag behind add() by up to a flush interval.
+  unsigned long count(const std::string& reply)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = counts_.find(reply);
+    return it == counts_.end() ? 0 : it->second;
+  }
+
+  std::size_t size()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return counts_.size();
+  }
+
+private:
+  typedef std::unordered_map<std::string, unsigned long> count_map;
+
+  void load()
+  {
+    std::ifstream snapshot(snapshot_path_);
+    std::string line;
+    while (std::getline(snapshot, line))
+    {
+      std::string::size_type space = line.rfind(' ');
+      if (space == std::string::npos)
+        continue;
+      counts_[line.substr(0, space)] += std::strtoul(line.c_str() + space + 1, 0, 10);
+    }
+
+    std::ifstream log(log_path_);
+    while (std::getline(log, line))
+    {
+      ++counts_[line];
+      ++log_lines_;
+    }
+  }
+
+  void run()
+  {
+    std::vector<std::string> batch;
+    count_map snapshot;
+    while (true)
+    {
+      bool stopping;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait_for(lock, std::chrono::milliseconds(flush_interval_ms),
+            [this](){ return stopping_; });
+        stopping = stopping_;
+      }
+
+      //Emptied after stopping_ is read, so the last round takes every reply
+      //added before close(). The stripes keep their capacity.
+      for (auto& pending: pending_)
+      {
+        std::lock_guard<std::mutex> lock(pending.mutex);
+        std::move(pending.replies.begin(), pending.replies.end(),
+            std::back_inserter(batch));
+        pending.replies.clear();
+      }
+
+      if (!batch.empty())
+      {
+        //The copy holds exactly the replies logged so far plus this batch.
+        bool compact;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          for (const auto& reply: batch)
+            ++counts_[reply];
+          compact = log_lines_ + batch.size()
+            > std::max<std::size_t>(min_compact_lines, counts_.size());
+          if (compact)
+            snapshot = counts_;
+        }
+
+        if (compact)
+        {
+          write_snapshot(snapshot);
+          snapshot.clear();
+          log_.close();
+          log_.open(log_path_, std::ofstream::trunc);
+          log_lines_ = 0;
+        }
+        else
+        {
+          for (const auto& reply: batch)
+            log_ << reply << '\n';
+          log_.flush();
+          log_lines_ += batch.size();
+        }
+        batch.clear();
+      }
+
+      if (stopping)
+        return;
+    }
+  }
+
+  void write_snapshot(const count_map& counts)
+  {
+    std::string temp_path = snapshot_path_ + ".new";
+    {
+      std::ofstream out(temp_path, std::ofstream::trunc);
+      for (const auto& entry: counts)
+        out << entry.first << ' ' << entry.second << '\n';
+    }
+    std::rename(temp_path.c_str(), snapshot_path_.c_str());
+  }
+
+  std::string snapshot_path_;
+  std::string log_path_;
+  //Replies added and not yet taken by the writer.
+  struct alignas(64) stripe
+  {
+    std::mutex mutex;
+    std::vector<std::string> replies;
+  };
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stopping_;
+  count_map counts_; //Only changed by the writer thread once it is running.
+  stripe pending_[metric_stripes::count];
+  //Only touched by the writer thread once it is running.
+  std::thread writer_;
+  std::ofstream log_;
+  std::size_t log_lines_;
+};
+
+#endif // REPLY_COUNTER_HPP
@@ -0,0 +1,89 @@
+//
+// ring_buffer.hpp
+// ~~~~~~~~~~~~~~~
+//
+// A fixed-capacity byte ring that socket reads fill and frame parsing drains.
+//
+
+#ifndef RING_BUFFER_HPP
+#define RING_BUFFER_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include "asio.hpp"
+
+class ring_buffer
+{
+public:
+  typedef std::array<asio::mutable_buffer, 2> mutable_buffers_type;
+
+  //The capacity is rounded up to a power of two.
+  explicit ring_buffer(std::size_t capacity)
+    : head_(0),
+      size_(0)
+  {
+    std::size_t c = 1;
+    while (c < capacity)
+      c <<= 1;
+    data_.resize(c);
+  }
+
+  std::size_t size() const
+  {
+    return size_;
+  }
+
+  std::size_t capacity() const
+  {
+    return data_.size();
+  }
+
+  //The free space as (at most) two regions, so one read can fill all of it.
+  mutable_buffers_type prepare()
+  {
+    std::size_t tail = (head_ + size_) & mask();
+    std::size_t space = capacity() - size_;
+    std::size_t first = std::min(space, capacity() - tail);
+    mutable_buffers_type buffers = {{
+      asio::buffer(&data_[tail], first),
+      asio::buffer(&data_[0], space - first) }};
+    return buffers;
+  }
+
+  //Marks n bytes written into the regions returned by prepare() as readable.
+  void commit(std::size_t n)
+  {
+    size_ += n;
+  }
+
+  //Copies the first n readable bytes out without consuming them.
+  void peek(char* out, std::size_t n) const
+  {
+    std::size_t first = std::min(n, capacity() - head_);
+    std::memcpy(out, &data_[head_], first);
+    std::memcpy(out + first, &data_[0], n - first);
+  }
+
+  void consume(std::size_t n)
+  {
+    head_ = (head_ + n) & mask();
+    size_ -= n;
+    if (size_ == 0)
+      head_ = 0; //Keeps the next read in one region.
+  }
+
+private:
+  std::size_t mask() const
+  {
+    return data_.size() - 1;
+  }
+
+  std::vector<char> data_;
+  std::size_t head_;
+  std::size_t size_;
+};
+
+#endif // RING_BUFFER_HPP
@@ -0,0 +1,279 @@
+//
+// server_metrics.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Counters and histograms the server updates on its hot paths.
+//
+
+#ifndef SERVER_METRICS_HPP
+#define SERVER_METRICS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+  Every counter and histogram is split into stripes, each on its own cache
+  lines, and a thread always updates the same stripe with a relaxed atomic
+  add. Threads running different shards therefore never share a cache line
+  on the hot path; only a reader, summing the stripes, touches them all.
+  The sums are not a consistent snapshot across metrics, which is fine for
+  watching a live server.
+*/
+struct metric_stripes
+{
+  enum { count = 16 };
+
+  //The stripe of the calling thread, handed out in turn.
+  static std::size_t current()
+  {
+    static std::atomic<std::size_t> next(0);
+    static thread_local std::size_t stripe = next.fetch_add(1) % count;
+    return stripe;
+  }
+};
+
+class metric_counter
+{
+public:
+  metric_counter()
+  {
+    for (auto& slot: slots_)
+      slot.value.store(0, std::memory_order_relaxed);
+  }
+
+  metric_counter(const metric_counter&) = delete;
+  metric_counter& operator=(const metric_counter&) = delete;
+
+  void add(std::uint64_t n = 1)
+  {
+    slots_[metric_stripes::current()].value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  std::uint64_t read() const
+  {
+    std::uint64_t sum = 0;
+    for (const auto& slot: slots_)
+      sum += slot.value.load(std::memory_order_relaxed);
+    return sum;
+  }
+
+private:
+  struct alignas(64) slot
+  {
+    std::atomic<std::uint64_t> value;
+  };
+
+  slot slots_[metric_stripes::count];
+};
+
+/*
+  Histograms count values in buckets of 1/16 of a power of two, so a
+  percentile is off by at most about 6% over the whole 64 bit range, in
+  1024 buckets of 8 bytes.
+*/
+struct histogram_buckets
+{
+  enum { sub_bits = 4 };
+  enum { sub_buckets = 1 << sub_bits };
+  enum { count = 64 * sub_buckets };
+
+  static std::size_t index(std::uint64_t value)
+  {
+    if (value < sub_buckets)
+      return value;
+    int exponent = 63 - __builtin_clzll(value);
+    return (exponent - sub_bits + 1) * sub_buckets
+      + ((value >> (exponent - sub_bits)) & (sub_buckets - 1));
+  }
+
+  //The largest value counted in bucket i.
+  static std::uint64_t upper_bound(std::size_t i)
+  {
+    if (i < sub_buckets)
+      return i;
+    int exponent = i / sub_buckets + sub_bits - 1;
+    std::uint64_t next = sub_buckets + i % sub_buckets + 1;
+    return (next << (exponent - sub_bits)) - 1; //Wraps to the maximum for the last bucket.
+  }
+};
+
+//A histogram for one thread: what a metric_histogram held when it was
+//read, or one a single thread records into itself.
+struct histogram
+{
+  histogram()
+    : counts(histogram_buckets::count, 0),
+      total(0),
+      max(0)
+  {
+  }
+
+  void record(std::uint64_t value)
+  {
+    ++counts[histogram_buckets::index(value)];
+    ++total;
+    max = std::max(max, value);
+  }
+
+  void merge(const histogram& other)
+  {
+    for (std::size_t i = 0; i < counts.size(); ++i)
+      counts[i] += other.counts[i];
+    total += other.total;
+    max = std::max(max, other.max);
+  }
+
+  //The upper bound of the bucket holding the p-th value, 0 <= p <= 1,
+  //never more than max.
+  std::uint64_t percentile(double p) const;
+
+  std::vector<std::uint64_t> counts; //Per bucket.
+  std::uint64_t total;
+  //The largest value recorded; read from a metric_histogram, the upper
+  //bound of its highest non-empty bucket.
+  std::uint64_t max;
+};
+
+inline std::uint64_t histogram::percentile(double p) const
+{
+  if (total == 0)
+    return 0;
+  std::uint64_t target = std::max<std::uint64_t>(1,
+      static_cast<std::uint64_t>(std::ceil(p * total)));
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < counts.size(); ++i)
+  {
+    seen += counts[i];
+    if (seen >= target)
+      return std::min(histogram_buckets::upper_bound(i), max);
+  }
+  return max;
+}
+
+//A histogram any thread records into, in 8 KB per stripe.
+class metric_histogram
+{
+public:
+  metric_histogram()
+  {
+    for (auto& stripe: stripes_)
+      for (auto& count: stripe.counts)
+        count.store(0, std::memory_order_relaxed);
+  }
+
+  metric_histogram(const metric_histogram&) = delete;
+  metric_histogram& operator=(const metric_histogram&) = delete;
+
+  void record(std::uint64_t value)
+  {
+    stripes_[metric_stripes::current()].counts[histogram_buckets::index(value)]
+      .fetch_add(1, std::memory_order_relaxed);
+  }
+
+  histogram read() const
+  {
+    histogram result;
+    for (const auto& stripe: stripes_)
+      for (std::size_t i = 0; i < histogram_buckets::count; ++i)
+        result.counts[i] += stripe.counts[i].load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < histogram_buckets::count; ++i)
+    {
+      result.total += result.counts[i];
+      if (result.counts[i] != 0)
+        result.max = histogram_buckets::upper_bound(i);
+    }
+    return result;
+  }
+
+private:
+  struct alignas(64) stripe
+  {
+    std::atomic<std::uint64_t> counts[histogram_buckets::count];
+  };
+
+  stripe stripes_[metric_stripes::count];
+};
+
+//The server's metrics, read by the admin socket.
+struct server_metrics
+{
+  //Microseconds on the steady clock, for timing deliveries.
+  static std::uint64_t now()
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  static metric_counter& connections_accepted()
+  {
+    static metric_counter counter;
+    return counter;
+  }
+
+  static metric_counter& connections_closed()
+  {
+    static metric_counter counter;
+    return counter;
+  }
+
+  static metric_counter& bytes_in()
+  {
+    static metric_counter counter;
+    return counter;
+  }
+
+  static metric_counter& bytes_out()
+  {
+    static metric_counter counter;
+    return counter;
+  }
+
+  //Frames read from clients.
+  static metric_counter& messages_in()
+  {
+    static metric_counter counter;
+    return counter;
+  }
+
+  //Frames written to clients.
+  static metric_counter& messages_out()
+  {
+    static metric_counter counter;
+    return counter;
+  }
+
+  //Calls to the global operator new, in a program that replaces it to count them.
+  static metric_counter& heap_allocations()
+  {
+    static metric_counter counter;
+    return counter;
+  }
+
+  //Participants every room message was delivered to.
+  static metric_histogram& fan_out()
+  {
+    static metric_histogram histogram;
+    return histogram;
+  }
+
+  //Messages waiting in a session's write queue, each time one is queued.
+  static metric_histogram& queue_depth()
+  {
+    static metric_histogram histogram;
+    return histogram;
+  }
+
+  //Microseconds from a message being queued for a client to it being written.
+  static metric_histogram& delivery_latency()
+  {
+    static metric_histogram histogram;
+    return histogram;
+  }
+};
+
+#endif // SERVER_METRICS_HPP
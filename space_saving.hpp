@@ -0,0 +1,171 @@
+//
+// space_saving.hpp
+// ~~~~~~~~~~~~~~~~
+//
+// Approximate most frequent items of a stream in bounded memory.
+//
+
+#ifndef SPACE_SAVING_HPP
+#define SPACE_SAVING_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+  The Space-Saving algorithm keeps at most capacity counters. An item that
+  is already counted is incremented; a new item takes over the smallest
+  counter, inheriting its count as the possible overestimate. Any item seen
+  more than total / capacity times is guaranteed to hold a counter, and
+  every count is too high by at most its error.
+
+  Counters are kept ordered by count as well as hashed by item, so an update
+  costs O(log capacity) and reading the top k walks k entries from the end.
+
+  Summaries of separate streams merge into one for the combined stream,
+  with the same guarantee, so each thread can count into its own.
+*/
+class space_saving
+{
+public:
+  struct item
+  {
+    std::string value;
+    unsigned long count;
+    unsigned long error; //count - error is a lower bound.
+  };
+
+  explicit space_saving(std::size_t capacity)
+    : capacity_(capacity ? capacity : 1)
+  {
+  }
+
+  void add(const std::string& value)
+  {
+    auto it = counters_.find(value);
+    if (it != counters_.end())
+    {
+      by_count_.erase(key(it));
+      ++it->second.count;
+      by_count_.insert(key(it));
+      return;
+    }
+
+    counter c = { 1, 0 };
+    if (counters_.size() == capacity_)
+    {
+      //The new item replaces the least counted one.
+      auto smallest = by_count_.begin();
+      c.error = smallest->first;
+      c.count = smallest->first + 1;
+      std::string victim = smallest->second->first;
+      by_count_.erase(smallest);
+      counters_.erase(victim);
+    }
+    it = counters_.emplace(value, c).first;
+    by_count_.insert(key(it));
+  }
+
+  //The k highest counts, highest first.
+  std::vector<item> top(std::size_t k) const
+  {
+    std::vector<item> result;
+    for (auto it = by_count_.rbegin(); it != by_count_.rend() && result.size() < k; ++it)
+    {
+      const counter& c = it->second->second;
+      item i = { it->second->first, c.count, c.error };
+      result.push_back(i);
+    }
+    return result;
+  }
+
+  //Adds the counts of other, as if its stream had been added here too. An
+  //item a full summary holds no counter for may have been seen as often as
+  //its smallest count, which is added to the item's count and error.
+  void merge(const space_saving& other)
+  {
+    unsigned long floor = smallest_count();
+    unsigned long other_floor = other.smallest_count();
+    std::vector<std::pair<std::string, counter>> merged;
+    for (const auto& entry: counters_)
+    {
+      auto it = other.counters_.find(entry.first);
+      counter c = entry.second;
+      c.count += it != other.counters_.end() ? it->second.count : other_floor;
+      c.error += it != other.counters_.end() ? it->second.error : other_floor;
+      merged.push_back(std::make_pair(entry.first, c));
+    }
+    for (const auto& entry: other.counters_)
+    {
+      if (counters_.count(entry.first) != 0)
+        continue;
+      counter c = entry.second;
+      c.count += floor;
+      c.error += floor;
+      merged.push_back(std::make_pair(entry.first, c));
+    }
+
+    //Only the highest counts keep their counters.
+    if (merged.size() > capacity_)
+    {
+      std::nth_element(merged.begin(), merged.begin() + capacity_, merged.end(),
+          [](const std::pair<std::string, counter>& a,
+            const std::pair<std::string, counter>& b)
+          {
+            return a.second.count > b.second.count;
+          });
+      merged.resize(capacity_);
+    }
+    clear();
+    for (auto& entry: merged)
+      by_count_.insert(key(counters_.emplace(std::move(entry.first), entry.second).first));
+  }
+
+  void clear()
+  {
+    by_count_.clear();
+    counters_.clear();
+  }
+
+  std::size_t size() const
+  {
+    return counters_.size();
+  }
+
+  std::size_t capacity() const
+  {
+    return capacity_;
+  }
+
+private:
+  struct counter
+  {
+    unsigned long count;
+    unsigned long error;
+  };
+
+  typedef std::unordered_map<std::string, counter> counter_map;
+  //The map's nodes never move, so the ordered index points into them.
+  typedef std::pair<unsigned long, const counter_map::value_type*> count_key;
+
+  static count_key key(counter_map::const_iterator it)
+  {
+    return count_key(it->second.count, &*it);
+  }
+
+  //What an item without a counter may have been counted, at most.
+  unsigned long smallest_count() const
+  {
+    return counters_.size() < capacity_ ? 0 : by_count_.begin()->first;
+  }
+
+  std::size_t capacity_;
+  counter_map counters_;
+  std::set<count_key> by_count_;
+};
+
+#endif // SPACE_SAVING_HPP
@@ -0,0 +1,137 @@
+//
+// timing_wheel.hpp
+// ~~~~~~~~~~~~~~~~
+//
+// One hashed timing wheel per io_context for cheap, coarse timeouts.
+//
+
+#ifndef TIMING_WHEEL_HPP
+#define TIMING_WHEEL_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "asio.hpp"
+
+/*
+  A single steady_timer per io_context ticks once a second and visits one
+  slot of the wheel; an entry due at tick t lives in slot t % num_slots, so
+  adding one is a push_back. Entries are checks rather than fixed
+  deadlines: when its tick comes, a check is called with the current tick
+  and returns the tick it wants to be called at next, or 0 to be dropped.
+  Objects that see frequent activity therefore never touch the wheel at
+  all; they just record the tick of their latest activity and let the
+  check, once it runs, decide whether they really timed out.
+
+  Checks run on the wheel's own strand and must only read state that is
+  safe to read from there (atomics, say), handing any real work over to
+  their owner's executor.
+
+  The wheel is an asio service, so asio::use_service<timing_wheel>(io)
+  returns the one wheel of that io_context, created the first time. Its id
+  is defined once, by the program using the wheel.
+*/
+class timing_wheel
+  : public asio::execution_context::service
+{
+public:
+  static asio::execution_context::id id;
+
+  typedef std::function<std::uint64_t(std::uint64_t now)> check_type;
+
+  enum { num_slots = 256 };
+
+  explicit timing_wheel(asio::io_context& io_context)
+    : asio::execution_context::service(io_context),
+      strand_(io_context.get_executor()),
+      timer_(io_context),
+      slots_(num_slots),
+      now_(1),
+      running_(false)
+  {
+  }
+
+  //The current tick, counted in seconds from the wheel's creation.
+  std::uint64_t now() const
+  {
+    return now_.load(std::memory_order_relaxed);
+  }
+
+  //Calls check at tick due (or the next tick if due has already passed).
+  void add(std::uint64_t due, check_type check)
+  {
+    auto entry = std::make_shared<std::pair<std::uint64_t, check_type>>(
+        due, std::move(check));
+    asio::dispatch(strand_,
+        [this, entry]()
+        {
+          insert(entry->first, std::move(entry->second));
+          if (!running_)
+          {
+            running_ = true;
+            schedule();
+          }
+        });
+  }
+
+private:
+  typedef std::pair<std::uint64_t, check_type> entry_type;
+
+  void shutdown()
+  {
+    std::error_code ignored;
+    timer_.cancel(ignored);
+  }
+
+  void insert(std::uint64_t due, check_type check)
+  {
+    std::uint64_t now = this->now();
+    if (due <= now)
+      due = now + 1;
+    slots_[due % num_slots].push_back(entry_type(due, std::move(check)));
+  }
+
+  void schedule()
+  {
+    timer_.expires_after(std::chrono::seconds(1));
+    timer_.async_wait(asio::bind_executor(strand_,
+        [this](std::error_code ec)
+        {
+          if (!ec)
+            tick();
+        }));
+  }
+
+  void tick()
+  {
+    std::uint64_t now = now_.fetch_add(1, std::memory_order_relaxed) + 1;
+    visiting_.clear();
+    visiting_.swap(slots_[now % num_slots]);
+    for (auto& entry: visiting_)
+    {
+      if (entry.first > now) //Due in a later turn of the wheel.
+      {
+        slots_[now % num_slots].push_back(std::move(entry));
+        continue;
+      }
+      std::uint64_t next = entry.second(now);
+      if (next != 0)
+        insert(next, std::move(entry.second));
+    }
+    schedule();
+  }
+
+  asio::strand<asio::io_context::executor_type> strand_;
+  asio::steady_timer timer_;
+  std::vector<std::vector<entry_type>> slots_;
+  std::vector<entry_type> visiting_;
+  std::atomic<std::uint64_t> now_;
+  bool running_;
+};
+
+#endif // TIMING_WHEEL_HPP